@@ -1,8 +1,11 @@
 
 #pragma once
 
+#include <vector>
+#include <algorithm>
 #include "GraphCut.hpp"
 #include "ImageUtils.hpp"
+#include "FilterUtils.hpp"
 #include "Globals.hpp"
 
 namespace AnnotatedGC {
@@ -13,34 +16,37 @@ namespace AnnotatedGC {
     const Label BACKGROUND   = 0;
     const int COST_AMPLIFIER = 1000;
 
+    /*
+    Data cost of segmenting one label of the annotated image: voxels
+    annotated with the label are foreground, voxels annotated with any
+    other label are background, other voxels have no data cost.
+    */
     class AnnotatedSheetnessDataCost : public GCSegm::DataCostFunction {
     private:
         ShortImagePtr intensity;
         FloatImagePtr sheetness;
-        UCharImagePtr backgroundEstimation;
-        UCharImagePtr foregroundEstimation;
+        UCharImagePtr annotated;
+        unsigned char currentLabel;
     public:
         // constructor
         AnnotatedSheetnessDataCost(
             ShortImagePtr p_intensity,
             FloatImagePtr p_sheetnessMeasure,
-            UCharImagePtr p_backgroundEstimation,
-            UCharImagePtr p_foregroundEstimation
+            UCharImagePtr p_annotated,
+            unsigned char p_currentLabel
         )
         : intensity(p_intensity)
         , sheetness(p_sheetnessMeasure)
-        , backgroundEstimation(p_backgroundEstimation)
-        , foregroundEstimation(p_foregroundEstimation)
+        , annotated(p_annotated)
+        , currentLabel(p_currentLabel)
         { /* empty body */}
 
         virtual int compute(ImageIndex idx, Label label) {
-            short hu = intensity->GetPixel(idx);
             float s = sheetness->GetPixel(idx);
-            unsigned char back = backgroundEstimation->GetPixel(idx);
-            unsigned char fore = foregroundEstimation->GetPixel(idx);
+            unsigned char annotation = annotated->GetPixel(idx);
+            unsigned char back = (annotation != 0 && annotation != currentLabel) ? 1 : 0;
+            unsigned char fore = (annotation == currentLabel) ? 1 : 0;
 
-            assert( back==0 || back==1);
-            assert( fore==0 || fore==1);
             assert( s > -1.001 && s < 1.001);
 
             float totalCost;
@@ -97,25 +103,323 @@ namespace AnnotatedGC {
         }
     };
 
-    UCharImagePtr compute(
-        ShortImagePtr intensity,
-        FloatImagePtr sheetnessMeasure,
-        UCharImagePtr backgroundEstimation,
-        UCharImagePtr foregroundEstimation,
-        UCharImagePtr roi
-    ) {
-        // data cost functions
-        AnnotatedSheetnessDataCost dataCostFunction(intensity, sheetnessMeasure, backgroundEstimation, foregroundEstimation);
-        AnnotatedSheetnessSmoothCost smoothCostFunction(intensity,sheetnessMeasure);
-
-        // graph-cut segmentation
-        GCSegm gcSegm;
-        UIntImagePtr gcOutput = gcSegm.optimize(
-            FilterUtils<UCharImage,UIntImage>::cast(roi),
-            &dataCostFunction, &smoothCostFunction
-        );
+    // unannotated voxels below this HU with nonpositive sheetness are
+    // assumed to be background in a band-restricted graph
+    const short IMPOSSIBLE_FOREGROUND_HU = -500;
+
+    // voxels of the graph ROI of LabelSegmentation
+    const unsigned char OUTSIDE_GRAPH = 0;  // outside the ROI
+    const unsigned char IN_GRAPH      = 1;
+    const unsigned char EXCLUDED      = 2;  // in the band, assumed background
+    const unsigned char OUTSIDE_BAND  = 3;  // in the ROI, assumed background
 
-        // finitto :)
-        return FilterUtils<UIntImage,UCharImage>::cast(gcOutput);
+    // voxels of the ROI left out of the graph and fixed to background
+    inline bool isFixedBackground(unsigned char graphLabel) {
+        return graphLabel == EXCLUDED || graphLabel == OUTSIDE_BAND;
     }
+
+
+
+    /*
+    Data cost in a graph without the voxels fixed to background (excluded
+    and outside the band): the annotation cost (if any) plus, for the
+    foreground, the smoothness costs to the fixed neighbours.
+
+    This is a heuristic approximation of the graph over the whole ROI. The
+    energy does not depend on HU, so in the whole graph a fixed voxel may be
+    foreground (e.g. a low-HU pocket enclosed by bone), and the cut can
+    differ from the cut of the whole graph there.
+    */
+    class ExcludedNeighboursDataCost : public GCSegm::DataCostFunction {
+    private:
+        GCSegm::DataCostFunction *annotationCost;
+        GCSegm::SmoothnessCostFunction *smoothCost;
+        UCharImagePtr graphRoi;
+        ImageSize size;
+    public:
+        ExcludedNeighboursDataCost(
+            GCSegm::DataCostFunction *p_annotationCost,
+            GCSegm::SmoothnessCostFunction *p_smoothCost,
+            UCharImagePtr p_graphRoi
+        )
+        : annotationCost(p_annotationCost)
+        , smoothCost(p_smoothCost)
+        , graphRoi(p_graphRoi)
+        , size(p_graphRoi->GetLargestPossibleRegion().GetSize())
+        { /* empty body */}
+
+        virtual int compute(ImageIndex idx, Label label) {
+            int cost = (annotationCost != NULL) ? annotationCost->compute(idx, label) : 0;
+            if (label != FOREGROUND)
+                return cost;
+
+            for (unsigned dim = 0; dim < Dimension; ++dim)
+                for (int step = -1; step <= 1; step += 2) {
+                    ImageIndex neighbour = idx;
+                    neighbour[dim] += step;
+                    if (neighbour[dim] < 0 || neighbour[dim] >= (long)size[dim])
+                        continue;
+                    if (isFixedBackground(graphRoi->GetPixel(neighbour)))
+                        cost += smoothCost->compute(idx, neighbour);
+                }
+            return cost;
+        }
+    };
+
+
+
+    /*
+    Segmentation of the labels of an annotated image, one label at a time
+    against all other annotated labels, within the same ROI.
+
+    The graph with the sheetness-based smoothness costs is built once. Data
+    costs are nonzero only for annotated voxels, so for each label only the
+    t-links of the annotated voxels (and of the voxels annotated in the
+    previous call) are rewritten, and the max flow is recomputed reusing
+    the search trees of the previous label.
+
+    With a band width, the graph only covers the slices (along z) within
+    that many slices of an annotated slice, without the unannotated voxels
+    which are unlikely to be foreground (see ExcludedNeighboursDataCost).
+    Voxels left out, including those beyond the band, are fixed to
+    background. The graph is rebuilt when annotations are added outside it
+    or on excluded voxels, and the band is doubled while the segmentation
+    touches a slice next to its border.
+    */
+    class LabelSegmentation {
+    private:
+        ShortImagePtr intensity;
+        FloatImagePtr sheetness;
+        UCharImagePtr roi;
+        unsigned bandWidth;
+
+        // slices in the band, empty before the band graph is built
+        std::vector<bool> bandSlices;
+
+        // OUTSIDE_GRAPH, IN_GRAPH, EXCLUDED or OUTSIDE_BAND for each voxel
+        UCharImagePtr graphRoi;
+
+        GCSegm gcSegm;
+
+        // voxels with nonzero data costs, offsets in the image buffer
+        std::vector<size_t> annotatedPixels;
+
+
+
+        // slices containing an annotated voxel
+        std::vector<bool> annotatedSlices(UCharImagePtr annotatedImage) {
+            ImageSize size = annotatedImage->GetLargestPossibleRegion().GetSize();
+            const size_t sliceSize = size[0] * size[1];
+            const unsigned char *annotation = annotatedImage->GetBufferPointer();
+
+            std::vector<bool> slices(size[2], false);
+            for (unsigned z = 0; z < size[2]; ++z) {
+                const unsigned char *slice = annotation + z * sliceSize;
+                for (size_t i = 0; i < sliceSize && !slices[z]; ++i)
+                    slices[z] = (slice[i] != 0);
+            }
+            return slices;
+        }
+
+
+
+        // true if no annotated voxel is fixed to background in the band graph
+        bool bandCoversAnnotations(UCharImagePtr annotatedImage) {
+            if (bandSlices.empty())
+                return false;
+            const unsigned char *annotation = annotatedImage->GetBufferPointer();
+            const unsigned char *graph = graphRoi->GetBufferPointer();
+            size_t total = annotatedImage->GetLargestPossibleRegion().GetNumberOfPixels();
+            for (size_t i = 0; i < total; ++i)
+                if (annotation[i] != 0 && isFixedBackground(graph[i]))
+                    return false;
+            return true;
+        }
+
+
+
+        bool bandCoversVolume() {
+            return std::find(bandSlices.begin(), bandSlices.end(), false) == bandSlices.end();
+        }
+
+
+
+        // true if a foreground voxel lies in a slice next to a slice outside the band
+        bool touchesBandBorder(UCharImagePtr segmentation) {
+            ImageSize size = segmentation->GetLargestPossibleRegion().GetSize();
+            const size_t sliceSize = size[0] * size[1];
+            const unsigned char *labels = segmentation->GetBufferPointer();
+
+            for (unsigned z = 0; z < size[2]; ++z) {
+                bool border =
+                    bandSlices[z] &&
+                    ((z > 0 && !bandSlices[z-1]) || (z + 1 < size[2] && !bandSlices[z+1]));
+                if (!border)
+                    continue;
+                const unsigned char *slice = labels + z * sliceSize;
+                if (std::find_if(slice, slice + sliceSize,
+                        [](unsigned char l) { return l != 0; }) != slice + sliceSize)
+                    return true;
+            }
+            return false;
+        }
+
+
+
+        void buildGraph() {
+            AnnotatedSheetnessSmoothCost smoothCostFunction(intensity, sheetness);
+            gcSegm.buildGraph(
+                FilterUtils<UCharImage,UIntImage>::binaryThresholding(graphRoi, IN_GRAPH, IN_GRAPH),
+                &smoothCostFunction);
+            annotatedPixels.clear();
+        }
+
+
+
+        void buildBandGraph(UCharImagePtr annotatedImage) {
+            ImageSize size = annotatedImage->GetLargestPossibleRegion().GetSize();
+            const size_t sliceSize = size[0] * size[1];
+            const int depth = size[2];
+
+            std::vector<bool> annotated = annotatedSlices(annotatedImage);
+            bandSlices.assign(depth, false);
+            for (int z = 0; z < depth; ++z) {
+                if (!annotated[z])
+                    continue;
+                int from = std::max(0, z - (int)bandWidth);
+                int to = std::min(depth - 1, z + (int)bandWidth);
+                for (int zz = from; zz <= to; ++zz)
+                    bandSlices[zz] = true;
+            }
+
+            const unsigned char *annotation = annotatedImage->GetBufferPointer();
+            const unsigned char *inROI = roi->GetBufferPointer();
+            const short *hu = intensity->GetBufferPointer();
+            const float *sheet = sheetness->GetBufferPointer();
+
+            graphRoi = ImageUtils<UCharImage>::createEmpty(size);
+            graphRoi->CopyInformation(annotatedImage);
+            unsigned char *graph = graphRoi->GetBufferPointer();
+
+            size_t inGraph = 0;
+            for (int z = 0; z < depth; ++z)
+                for (size_t i = z * sliceSize; i < (z + 1) * sliceSize; ++i) {
+                    if (inROI[i] == 0)
+                        graph[i] = OUTSIDE_GRAPH;
+                    else if (!bandSlices[z])
+                        graph[i] = OUTSIDE_BAND;
+                    else if (annotation[i] == 0 && hu[i] < IMPOSSIBLE_FOREGROUND_HU && sheet[i] <= 0)
+                        graph[i] = EXCLUDED;
+                    else {
+                        graph[i] = IN_GRAPH;
+                        inGraph++;
+                    }
+                }
+
+            log("Annotation band of %d slices, %d of %d voxels in the graph")
+                % bandWidth % inGraph % (sliceSize * depth);
+
+            buildGraph();
+
+            // voxels next to ones fixed to background pay the smoothness costs to them
+            std::vector<size_t> boundary;
+            for (size_t i = 0; i < sliceSize * depth; ++i) {
+                if (graph[i] != IN_GRAPH)
+                    continue;
+                ImageIndex idx = graphRoi->ComputeIndex(i);
+                bool nextToFixed = false;
+                for (unsigned dim = 0; dim < Dimension && !nextToFixed; ++dim)
+                    for (int step = -1; step <= 1; step += 2) {
+                        ImageIndex neighbour = idx;
+                        neighbour[dim] += step;
+                        if (neighbour[dim] >= 0 && neighbour[dim] < (long)size[dim] &&
+                                isFixedBackground(graphRoi->GetPixel(neighbour)))
+                            nextToFixed = true;
+                    }
+                if (nextToFixed)
+                    boundary.push_back(i);
+            }
+
+            AnnotatedSheetnessSmoothCost smoothCostFunction(intensity, sheetness);
+            ExcludedNeighboursDataCost dataCostFunction(NULL, &smoothCostFunction, graphRoi);
+            gcSegm.updateDataCosts(&dataCostFunction, boundary);
+        }
+
+
+
+        UCharImagePtr solve(UCharImagePtr annotatedImage, unsigned char currentLabel) {
+
+            const unsigned char *annotation = annotatedImage->GetBufferPointer();
+            size_t total = annotatedImage->GetLargestPossibleRegion().GetNumberOfPixels();
+
+            // voxels annotated now, and voxels no longer annotated whose
+            // data costs have to be reset
+            std::vector<size_t> pixels;
+            for (size_t i = 0; i < total; ++i) {
+                if (annotation[i] != 0)
+                    pixels.push_back(i);
+            }
+            size_t nAnnotated = pixels.size();
+            for (size_t k = 0; k < annotatedPixels.size(); ++k) {
+                if (annotation[annotatedPixels[k]] == 0)
+                    pixels.push_back(annotatedPixels[k]);
+            }
+
+            AnnotatedSheetnessDataCost annotationCostFunction(
+                intensity, sheetness, annotatedImage, currentLabel);
+            AnnotatedSheetnessSmoothCost smoothCostFunction(intensity, sheetness);
+            ExcludedNeighboursDataCost dataCostFunction(
+                &annotationCostFunction, &smoothCostFunction, graphRoi);
+            gcSegm.updateDataCosts(&dataCostFunction, pixels);
+
+            pixels.resize(nAnnotated);
+            annotatedPixels.swap(pixels);
+
+            return FilterUtils<UIntImage,UCharImage>::cast(gcSegm.solve());
+        }
+
+
+    public:
+        /*
+        Graph over the voxels of the ROI (nonzero voxels), restricted to the
+        band around the annotated slices if @p_bandWidth > 0 (the graph is
+        then built by the first compute)
+        */
+        LabelSegmentation(
+            ShortImagePtr p_intensity,
+            FloatImagePtr p_sheetnessMeasure,
+            UCharImagePtr p_roi,
+            unsigned p_bandWidth = 0
+        )
+        : intensity(p_intensity)
+        , sheetness(p_sheetnessMeasure)
+        , roi(p_roi)
+        , bandWidth(p_bandWidth)
+        {
+            if (bandWidth == 0) {
+                graphRoi = FilterUtils<UCharImage,UCharImage>::binaryThresholding(
+                    roi, 1, 255, IN_GRAPH, OUTSIDE_GRAPH);
+                buildGraph();
+            }
+        }
+
+        UCharImagePtr compute(UCharImagePtr annotatedImage, unsigned char currentLabel) {
+
+            if (bandWidth == 0)
+                return solve(annotatedImage, currentLabel);
+
+            if (!bandCoversAnnotations(annotatedImage))
+                buildBandGraph(annotatedImage);
+
+            UCharImagePtr segmentation = solve(annotatedImage, currentLabel);
+            while (touchesBandBorder(segmentation) && !bandCoversVolume()) {
+                bandWidth *= 2;
+                log("Segmentation touches the border of the band, growing it to %d slices")
+                    % bandWidth;
+                buildBandGraph(annotatedImage);
+                segmentation = solve(annotatedImage, currentLabel);
+            }
+            return segmentation;
+        }
+    };
 }
@@ -3,8 +3,13 @@
 #include "FilterUtils.hpp"
 #include <string>
 #include <vector>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
 #include "boost/lexical_cast.hpp"
 #include "SheetnessMeasure.hpp"
+#include "UnsharpMasking.hpp"
 #include "annotated-gc.hxx"
 
 #define DEBUG (true)
@@ -40,18 +45,6 @@ struct FilenameDb {
             "/annotated-output-part-" + std::to_string(part) + ".nii";
         return m_tempDir + filename;
     }
-
-    std::string backgroundOutputPart(unsigned part) {
-        std::string filename =
-            "/annotated-background-part-" + std::to_string(part) + ".nii";
-        return m_tempDir + filename;
-    }
-
-    std::string foregroundOutputPart(unsigned part) {
-        std::string filename =
-            "/annotated-foreground-part-" + std::to_string(part) + ".nii";
-        return m_tempDir + filename;
-    }
 };
 
 FloatImagePtr multiscaleSheetness(
@@ -75,8 +68,8 @@ FloatImagePtr multiscaleSheetness(
         sheetnessFilter->SetObjectDimension(2);
         sheetnessFilter->SetBrightObject(true);
         sheetnessFilter->ScaleObjectnessMeasureOff();
-        sheetnessFilter->Update();
         sheetnessFilter->SetROIImage(roi);
+        sheetnessFilter->Update();
 
         FloatImagePtr singleScaleSheetness = sheetnessFilter->GetOutput();
 
@@ -109,6 +102,100 @@ FloatImagePtr multiscaleSheetness(
     return multiscaleSheetness;
 }
 
+/*
+Copy the annotations read from @filename into the slices of the annotated
+image starting at slice @firstSlice. The file may hold the whole volume or
+a few slices (e.g. a single 2D slice).
+*/
+void replaceAnnotations(UCharImagePtr annotatedImage, std::string filename, unsigned firstSlice) {
+
+    UCharImagePtr annotations = FilterUtils<ShortImage, UCharImage>::cast(
+        ImageUtils<ShortImage>::readImage(filename));
+
+    ImageSize size = annotatedImage->GetLargestPossibleRegion().GetSize();
+    ImageSize newSize = annotations->GetLargestPossibleRegion().GetSize();
+    if (newSize[0] != size[0] || newSize[1] != size[1] || firstSlice + newSize[2] > size[2])
+        throw std::runtime_error("annotations do not fit into the annotated image");
+
+    const unsigned char *src = annotations->GetBufferPointer();
+    unsigned char *dst = annotatedImage->GetBufferPointer() + firstSlice * size[0] * size[1];
+    std::copy(src, src + newSize[0] * newSize[1] * newSize[2], dst);
+}
+
+
+
+/*
+Resident mode: the CT, the sheetness and the graph are kept in memory and
+the annotations are edited by commands read from stdin, one per line:
+
+    annotations <file>          replace all annotations by the volume in <file>
+    slices <file> <z>           replace the annotations of the slices starting
+                                at <z> by the slices in <file>
+    segment <label> <file>      segment <label> and write the mask to <file>
+    quit
+
+Each command is answered on stdout by a line starting with "ok" or "error".
+Segmentation only rewrites the t-links of the annotated voxels and reuses
+the search trees of the previous max flow, so an edit of a few slices
+costs a fraction of the first segmentation.
+*/
+void serve(AnnotatedGC::LabelSegmentation & segmentation, UCharImagePtr annotatedImage) {
+
+    logSetStage("Serving");
+    log("Waiting for commands on stdin");
+
+    std::string line;
+    while (std::getline(std::cin, line)) {
+
+        std::istringstream arguments(line);
+        std::string command, filename;
+        arguments >> command;
+        if (command.empty())
+            continue;
+
+        try {
+            if (command == "quit") {
+                std::cout << "ok" << std::endl;
+                return;
+
+            } else if (command == "annotations") {
+                arguments >> filename;
+                log("Reading annotations %s") % filename;
+                replaceAnnotations(annotatedImage, filename, 0);
+                std::cout << "ok" << std::endl;
+
+            } else if (command == "slices") {
+                unsigned firstSlice;
+                if (!(arguments >> filename >> firstSlice))
+                    throw std::runtime_error("usage: slices <file> <z>");
+                log("Reading annotations of slices from %d, %s") % firstSlice % filename;
+                replaceAnnotations(annotatedImage, filename, firstSlice);
+                std::cout << "ok" << std::endl;
+
+            } else if (command == "segment") {
+                unsigned label;
+                if (!(arguments >> label >> filename) || label == 0 || label > 255)
+                    throw std::runtime_error("usage: segment <label 1..255> <file>");
+                log("Computing graph cut for label %d") % label;
+                UCharImagePtr segmentationImage = segmentation.compute(annotatedImage, label);
+                log("Writing label %d to %s") % label % filename;
+                ImageUtils<UCharImage>::writeImage(filename, segmentationImage);
+                std::cout << "ok " << filename << std::endl;
+
+            } else {
+                throw std::runtime_error("unknown command " + command);
+            }
+
+        } catch (itk::ExceptionObject & e) {
+            std::cout << "error " << e.GetDescription() << std::endl;
+        } catch (std::exception & e) {
+            std::cout << "error " << e.what() << std::endl;
+        }
+    }
+}
+
+
+
 int main(int argc, char * argv [])
 {
     if (sizeof(void*) == 8) {
@@ -117,8 +204,23 @@ int main(int argc, char * argv [])
         std::cerr << "\n";
     }
 
-	if (argc != 5) {
-	    std::cerr << "Usage: " << argv[0] << " input-CT-image input-annotated temp-folder output-image\n";
+	// options: --serve (see serve), --band <slices> (restrict the graph to
+	// the slices within <slices> of an annotated slice, 0 = whole volume)
+	bool resident = false;
+	unsigned annotationBand = 0;
+	bool validArguments = (argc >= 5);
+	for (int i = 5; i < argc && validArguments; ++i) {
+	    std::string option = argv[i];
+	    if (option == "--serve")
+	        resident = true;
+	    else if (option == "--band" && i + 1 < argc)
+	        annotationBand = boost::lexical_cast<unsigned>(argv[++i]);
+	    else
+	        validArguments = false;
+	}
+
+	if (!validArguments) {
+	    std::cerr << "Usage: " << argv[0] << " input-CT-image input-annotated temp-folder output-image [--serve] [--band slices]\n";
 	    return EXIT_FAILURE;
 	}
 
@@ -133,15 +235,12 @@ int main(int argc, char * argv [])
         input = ImageUtils<ShortImage>::readImage(filenames.input());
 
         log("Unsharp masking");
-        FloatImagePtr inputCTUnsharpMasked =
-            FilterUtils<FloatImage>::add(
-                FilterUtils<ShortImage,FloatImage>::cast(input),
-                FilterUtils<FloatImage>::linearTransform(
-                    FilterUtils<FloatImage>::substract(
-                        FilterUtils<ShortImage,FloatImage>::cast(input),
-                        FilterUtils<ShortImage,FloatImage>::gaussian(input, 1.0)), // larger appears to be better
-                    10.0, 0.0)
-            );
+        UnsharpMaskingFilter unsharpMasking;
+        unsharpMasking.SetImage(input);
+        unsharpMasking.SetVariance(1.0); // larger appears to be better
+        unsharpMasking.SetAmount(10.0);
+        unsharpMasking.Update();
+        FloatImagePtr inputCTUnsharpMasked = unsharpMasking.GetOutput();
         if (DEBUG) {
             log("Writing unsharp image to %s") % filenames.unsharp();
             ImageUtils<FloatImage>::writeImage(filenames.unsharp(), inputCTUnsharpMasked);
@@ -177,55 +276,24 @@ int main(int argc, char * argv [])
         ImageUtils<UCharImage>::writeImage(filenames.flat(), temp);
     }
 
-    // for (UCharImage::PixelType i = 0; i < nLabels; i++){
-    //     logSetStage("Segmentation #" + std::to_string(i));
-
-    //     UCharImage::PixelType currentLabel = i + 1;
-    //     log("Selecting label " + std::to_string(currentLabel));
-    //     UCharImagePtr foreground = FilterUtils<UCharImage, UCharImage>::binaryThresholding(annotatedImage, currentLabel, currentLabel);
-    //     UCharImagePtr background = FilterUtils<UCharImage, UCharImage>::substract(temp, foreground);
-
-    //     if (DEBUG) {
-    //         log("Writing background image to %s") % filenames.backgroundOutputPart(currentLabel);
-    //         ImageUtils<UCharImage>::writeImage(filenames.backgroundOutputPart(currentLabel), background);
-
-    //         log("Writing foreground image to %s") % filenames.foregroundOutputPart(currentLabel);
-    //         ImageUtils<UCharImage>::writeImage(filenames.foregroundOutputPart(currentLabel), foreground);
-    //     }
-
-    //     log("Computing graph cut");
-    //     UCharImagePtr currentSegmentationImage = AnnotatedGC::compute(
-    //         input, sheetness, background, foreground, roi
-    //     );
-
-    //     log("Writing label " + std::to_string(currentLabel)  + " to %s") % filenames.annotatedOutputPart(currentLabel);
-    //     ImageUtils<UCharImage>::writeImage(filenames.annotatedOutputPart(currentLabel), currentSegmentationImage);
-    // }
-
     logSetStage("Segmentation");
 
-        UCharImage::PixelType currentLabel = i + 1;
-        log("Selecting label " + std::to_string(currentLabel));
-        UCharImagePtr foreground = FilterUtils<UCharImage, UCharImage>::binaryThresholding(annotatedImage, currentLabel, currentLabel);
-        UCharImagePtr background = FilterUtils<UCharImage, UCharImage>::substract(temp, foreground);
+    // the graph is built once, each label only rewrites the t-links
+    AnnotatedGC::LabelSegmentation segmentation(input, sheetness, roi, annotationBand);
 
-        if (DEBUG) {
-            log("Writing background image to %s") % filenames.backgroundOutputPart(currentLabel);
-            ImageUtils<UCharImage>::writeImage(filenames.backgroundOutputPart(currentLabel), background);
+    for (unsigned currentLabel = 1; currentLabel <= nLabels; currentLabel++) {
 
-            log("Writing foreground image to %s") % filenames.foregroundOutputPart(currentLabel);
-            ImageUtils<UCharImage>::writeImage(filenames.foregroundOutputPart(currentLabel), foreground);
-        }
+        log("Computing graph cut for label %d") % currentLabel;
+        UCharImagePtr currentSegmentationImage =
+            segmentation.compute(annotatedImage, currentLabel);
 
-    log("Computing graph cut");
-    UCharImagePtr currentSegmentationImage = AnnotatedGC::compute(
-        input, sheetness, background, foreground, roi
-    );
-
-        log("Writing label " + std::to_string(currentLabel)  + " to %s") % filenames.annotatedOutputPart(currentLabel);
+        log("Writing label %d to %s") % currentLabel % filenames.annotatedOutputPart(currentLabel);
         ImageUtils<UCharImage>::writeImage(filenames.annotatedOutputPart(currentLabel), currentSegmentationImage);
     }
 
+    if (resident)
+        serve(segmentation, annotatedImage);
+
     logSetStage("Postprocessing");
 
 
@@ -1,66 +1,136 @@
 
 #include <iostream>
 
-#include "itkShapeDetectionLevelSetImageFilter.h"
-
 #include "ImageUtils.hpp"
 #include "FilterUtils.hpp"
 #include "Globals.hpp"
-#include "ChamferDistanceTransform.h"
-#include "itkGradientMagnitudeRecursiveGaussianImageFilter.h"
-#include "itkGeodesicActiveContourLevelSetImageFilter.h"
-#include "itkSigmoidImageFilter.h"
+#include "EuclideanDistanceTransform.hpp"
+#include "ConnectedComponents.hpp"
+#include "NarrowBandLevelSet.hpp"
+#include "GradientFeature.hpp"
 
 using namespace std;
 
-template<class ImageType>
-typename ImageType::Pointer
-joinDistances(
-    typename ImageType::Pointer img1, typename ImageType::Pointer img2
-){
-
-    itk::ImageRegionIteratorWithIndex<ImageType> it(
-        img1, img1->GetLargestPossibleRegion());
-    for (it.GoToBegin(); !it.IsAtEnd(); ++it) {
-        if (it.Get()==0)
-            it.Set(-img2->GetPixel(it.GetIndex()));
-    }
-
-    return img1;
+/*
+Initial level set: signed Euclidean distance to the boundary of the largest
+fat component (voxels below -50 HU), positive inside the fat and negative
+outside. The narrow-band level set only uses the values next to the zero
+crossing, so the distance is only computed in a band of 4 voxels and
+clamped beyond it.
+*/
+FloatImagePtr getInitialLevelSet(ShortImagePtr inputCT) {
+
+    UCharImagePtr fat =
+        ConnectedComponents<UCharImage>::largestComponent<UCharImage>(
+            FilterUtils<ShortImage,UCharImage>::binaryThresholding(inputCT, -5000, -50),
+            0, 1);
+
+    // fat is 0 within the component, so the signed distance
+    // (negative for nonzero voxels) is positive inside it
+    ShortImage::SpacingType spacing = inputCT->GetSpacing();
+    float maxSpacing = std::max(spacing[0], std::max(spacing[1], spacing[2]));
+
+    EuclideanDistanceTransform<UCharImage, FloatImage> edt;
+    edt.setSigned(true);
+    edt.setMaximumDistance(4 * maxSpacing);
+    return edt.compute(fat);
 }
 
-template<class ImageType>
-typename ImageType::Pointer chamferDistance(typename ImageType::Pointer image) {
-
-    typedef ChamferDistanceTransform<ImageType, ImageType> CDT;
-    CDT cdt;
-    return cdt.compute(image, CDT::MANHATTEN, false);
-}
 
 
-template<class ImageType>
-typename ImageType::Pointer getInitialLevelSet(typename ImageType::Pointer inputCT) {
-
-    IntImagePtr fat =
-        FilterUtils<IntImage>::binaryThresholding(
-            FilterUtils<IntImage>::relabelComponents(
-                FilterUtils<IntImage>::connectedComponents(
-                FilterUtils<ImageType,IntImage>::binaryThresholding(
-                    inputCT, -5000, -50)
-                )),
-            1,1,0,1
-        );
-
-    typename ImageType::Pointer distancesInside =
-        chamferDistance<ImageType>(FilterUtils<IntImage,ImageType>::cast(fat));
+// feature image: exp(-g/35) of the gradient magnitude g of the CT
+// smoothed by a gaussian with the given sigma
+FloatImagePtr getFeatureImage(ShortImagePtr inputCT, float sigma) {
+    GradientFeatureFilter featureFilter;
+    featureFilter.SetImage(inputCT);
+    featureFilter.SetSigma(sigma);
+    featureFilter.SetEdgeScale(35);
+    featureFilter.Update();
+    return featureFilter.GetOutput();
+}
 
-    typename ImageType::Pointer distancesOutside =
-        chamferDistance<ImageType>(FilterUtils<IntImage,ImageType>::cast(
-            FilterUtils<IntImage>::binaryThresholding(fat, 1,1,0,1)));
 
-    return joinDistances<ImageType>(distancesInside, distancesOutside);
 
+/*
+Evolve the contour coarse to fine. The feature image and the initial
+level set are downsampled by binning, 4x and 2x for three levels, and
+the level set of each level is linearly upsampled to initialize the next
+one. Anisotropic axes are downsampled less, so that the coarse voxels are
+as isotropic as possible; levels which would not downsample any axis are
+skipped.
+
+The front moves by a fraction of a voxel per iteration, so on a level
+downsampled by f a coarse iteration covers f times the distance of a full
+resolution one: the level gets numberOfIterations / f iterations and the
+maximum RMS change is scaled by f. The full resolution only refines the
+contour with refinementIterations iterations. With one level, this is
+the full-resolution evolution.
+*/
+FloatImagePtr evolveMultiResolution(
+    FloatImagePtr levelSet,
+    FloatImagePtr featureImage,
+    unsigned numberOfLevels,
+    float propagationScaling,
+    float curvatureScaling,
+    float advectionScaling,
+    float maximumRMSError,
+    unsigned numberOfIterations,
+    unsigned refinementIterations,
+    unsigned bandWidth
+) {
+    FloatImage::SpacingType spacing = featureImage->GetSpacing();
+    float minSpacing = std::min(spacing[0], std::min(spacing[1], spacing[2]));
+
+    // level set of the previous (coarser) level
+    FloatImagePtr current;
+
+    for (int level = numberOfLevels - 1; level >= 0; --level) {
+
+        unsigned levelFactor = 1u << level;
+
+        itk::FixedArray<unsigned, Dimension> factors;
+        bool downsample = false;
+        for (unsigned dim = 0; dim < Dimension; ++dim) {
+            unsigned factor = (unsigned) floor(levelFactor * minSpacing / spacing[dim] + 0.5);
+            factors[dim] = std::max(1u, factor);
+            downsample = downsample || (factors[dim] > 1);
+        }
+
+        if (level > 0 && !downsample)
+            continue;
+
+        FloatImagePtr levelFeature = downsample ?
+            FilterUtils<FloatImage>::binShrink(featureImage, factors) : featureImage;
+
+        FloatImagePtr levelInit;
+        if (!current)
+            levelInit = downsample ?
+                FilterUtils<FloatImage>::binShrink(levelSet, factors) : levelSet;
+        else
+            levelInit = FilterUtils<FloatImage>::resample(current, levelFeature);
+
+        unsigned iterations = (level == 0 && current) ?
+            refinementIterations : numberOfIterations / levelFactor;
+
+        log("Level set evolution, downsampled %dx%dx%d, at most %d iterations")
+            % factors[0] % factors[1] % factors[2] % iterations;
+
+        NarrowBandGeodesicActiveContour geodesicAC;
+
+        geodesicAC.SetInput(levelInit);
+        geodesicAC.SetFeatureImage(levelFeature);
+        geodesicAC.SetPropagationScaling( propagationScaling );
+        geodesicAC.SetCurvatureScaling( curvatureScaling );
+        geodesicAC.SetAdvectionScaling( advectionScaling );
+        geodesicAC.SetMaximumRMSError( maximumRMSError * levelFactor );
+        geodesicAC.SetNumberOfIterations( iterations );
+        geodesicAC.SetBandWidth( bandWidth );
+
+        geodesicAC.Update();
+        current = geodesicAC.GetOutput();
+    }
 
+    return current;
 }
 
 
@@ -85,68 +155,47 @@ int main(int argc, char * argv [])
     float maximumRMSError = 0.001;
     unsigned numberOfIterations = 400;
 
+    // layers of the narrow band on each side of the zero level set
+    unsigned bandWidth = 3;
+
+    // pyramid levels (4x, 2x, full resolution) and iterations at the
+    // full resolution after the coarse levels
+    unsigned numberOfLevels = 3;
+    unsigned refinementIterations = 50;
+
     // read the input image
-    FloatImagePtr inputCT = ImageUtils<FloatImage>::readImage(inputImage);
+    ShortImagePtr inputCT = ImageUtils<ShortImage>::readImage(inputImage);
 
     // initialize the level set
 #if 1
-    IntImagePtr levelSet = getInitialLevelSet<IntImage>(
-        FilterUtils<FloatImage, IntImage>::cast(inputCT));
-//    ImageUtils<IntImage>::writeImage(outputImage+"-level-set.nii", levelSet);
+    FloatImagePtr levelSet = getInitialLevelSet(inputCT);
+//    ImageUtils<FloatImage>::writeImage(outputImage+"-level-set.nii", levelSet);
 #else
-    IntImagePtr levelSet = ImageUtils<IntImage>::readImage(outputImage+"-level-set.nii");
+    FloatImagePtr levelSet = ImageUtils<FloatImage>::readImage(outputImage+"-level-set.nii");
 #endif
 
 //    printf("Sigma=%.2f, adv=%.2f, prop=%.2f, curv=%.2f, rms=%.2f, it=%d\n",
 //        gradientSigma, advectionScaling, propagationScaling, curvatureScaling,
 //        maximumRMSError, numberOfIterations);
 
-    // compute the feature image as sigmoid of gaussian
-    typedef itk::GradientMagnitudeRecursiveGaussianImageFilter<
-        FloatImage, FloatImage > GradientFilterType;
-    GradientFilterType::Pointer gradientFilter = GradientFilterType::New();
-    gradientFilter->SetSigma(gradientSigma);
-    gradientFilter->SetInput(inputCT);
-    gradientFilter->Update();
-    FloatImagePtr gradientImg = gradientFilter->GetOutput();
-//    ImageUtils<FloatImage>::writeImage(outputImage+"-gradient.nii", gradientImg);
-
-
-    // transform gradient into a feature image
-    itk::ImageRegionIterator<FloatImage> it(gradientImg, gradientImg->GetLargestPossibleRegion());
-    for (it.GoToBegin(); !it.IsAtEnd(); ++it) {
-        float g = it.Get();
-
-        float gNew = exp( -g / 35);
+    // compute the feature image
+    FloatImagePtr featureImage = getFeatureImage(inputCT, gradientSigma);
 
-        it.Set(gNew);
-    }
-
-    FloatImagePtr featureImage = gradientImg;
+    // the CT is not needed during the evolution
+    inputCT = 0;
  //   ImageUtils<FloatImage>::writeImage(outputImage+"-feature.nii", featureImage);
 
     // segment
-    typedef itk::GeodesicActiveContourLevelSetImageFilter<FloatImage,FloatImage> GeodesicAC;
-    GeodesicAC::Pointer geodesicAC = GeodesicAC::New();
-
-    geodesicAC->SetInput(FilterUtils<IntImage, FloatImage>::cast(levelSet));
-    geodesicAC->SetFeatureImage(featureImage);
-    geodesicAC->SetPropagationScaling( propagationScaling );
-    geodesicAC->SetCurvatureScaling( curvatureScaling );
-    geodesicAC->SetAdvectionScaling( advectionScaling );
-    geodesicAC->SetMaximumRMSError( maximumRMSError );
-    geodesicAC->SetNumberOfIterations( numberOfIterations );
-
-    geodesicAC->Update();
-    FloatImagePtr result = geodesicAC->GetOutput();
+    FloatImagePtr result = evolveMultiResolution(
+        levelSet, featureImage, numberOfLevels,
+        propagationScaling, curvatureScaling, advectionScaling,
+        maximumRMSError, numberOfIterations, refinementIterations, bandWidth);
 
     ImageUtils<UCharImage>::writeImage(
         outputImage,
         FilterUtils<FloatImage,UCharImage>::binaryThresholding(result, 0, 10000, 0,1)
     );
 
-//    cout << "Elapsed iterations: " << geodesicAC->GetElapsedIterations() << endl;
-//    cout << "RMS change: " << geodesicAC->GetRMSChange() << endl;
     cout << boost::format("%1%,%2%\n") % t.elapsed() % AVAILABLE_MEMORY_IN_MB;
 
 
@@ -26,6 +26,7 @@
 #include "boost/format.hpp"
 #include "boost/timer.hpp"
 #include <string>
+#include <mutex>
 
 const unsigned int Dimension = 3;
 
@@ -57,11 +58,13 @@ class MyLog {
 
    boost::timer m_timer;
    std::string m_stage;
+   std::mutex m_mutex; // log lines may come from several threads
 
 public:
 
    template <class T> void operator<<(T t) {
 
+       std::lock_guard<std::mutex> lock(m_mutex);
        unsigned int elapsed = m_timer.elapsed();
 
        boost::format logLine("%2d:%02d [%15s] - %s\n");
@@ -74,6 +77,7 @@ public:
    }
 
     void setStage(std::string stage) {
+        std::lock_guard<std::mutex> lock(m_mutex);
         m_stage = stage;
     }
 
@@ -0,0 +1,306 @@
+#pragma once
+
+
+#include "itkImage.h"
+#include <vector>
+#include <algorithm>
+#include "ImageUtils.hpp"
+#include "graph.h"
+#include "Globals.hpp"
+
+
+
+/*
+Multi-label segmentation by alpha-expansion moves as described in:
+
+ [1] Fast Approximate Energy Minimization via Graph Cuts,
+     Yuri Boykov, Olga Veksler, Ramin Zabih,
+     IEEE Transactions on PAMI, 2001
+
+ [2] What Energy Functions Can Be Minimized via Graph Cuts?,
+     Vladimir Kolmogorov, Ramin Zabih,
+     IEEE Transactions on PAMI, 2004
+
+The energy is
+
+    E(f) = sum_p D_p(f_p) + sum_{p,q} w_pq * [f_p != f_q]
+
+over 6-connected pixels p,q within the ROI (Potts model). The graph is
+built once per expansion into the same Graph object (reset between
+moves), the node ids and the costs are computed once.
+*/
+template<unsigned int Dimension> // dimension of the input image
+class AlphaExpansionSegmentation {
+
+public:
+    typedef unsigned LabelID;
+    typedef int EnergyTerm;
+
+    typedef typename itk::Image<LabelID, Dimension> LabelIdImage;
+    typedef typename LabelIdImage::IndexType ImageIndex;
+    typedef typename LabelIdImage::SizeType ImageRegionSize;
+    typedef typename LabelIdImage::Pointer LabelIdImagePointer;
+
+    typedef Graph<int,int,int> GraphType;
+
+    struct DataCostFunction {
+        /* Compute data cost of assigning @label (0..labels-1) to the pixel with index @idx */
+        virtual int compute(ImageIndex idx, LabelID label) = 0;
+    };
+
+    struct SmoothnessCostFunction {
+        /* Compute Potts weight between pixels at positions @idx1 and @idx2 */
+        virtual int compute(ImageIndex idx1, ImageIndex idx2 ) = 0;
+    };
+
+private:
+
+    struct Edge {
+        int p, q;
+        EnergyTerm weight;
+    };
+
+    unsigned _labels;
+
+    /* Data costs, _dataCosts[node * _labels + label] */
+    std::vector<EnergyTerm> _dataCosts;
+
+    std::vector<Edge> _edges;
+
+    /* Current label of each node */
+    std::vector<LabelID> _nodeLabels;
+
+    /* Linear index of each node in the ROI image */
+    std::vector<size_t> _nodePixels;
+
+    /* Scratch of the expansion moves, allocated once by optimize */
+    std::vector<EnergyTerm> _cost0, _cost1;
+    std::vector<LabelID> _previousLabels;
+
+
+
+    void buildNodesAndCosts(
+        LabelIdImagePointer roiImage,
+        DataCostFunction * dataCostFunction,
+        SmoothnessCostFunction * smoothnessCostFunction
+    ) {
+        ImageRegionSize size = roiImage->GetLargestPossibleRegion().GetSize();
+        const LabelID *roi = roiImage->GetBufferPointer();
+
+        size_t total = roiImage->GetLargestPossibleRegion().GetNumberOfPixels();
+        std::vector<int> nodeIds(total, -1);
+
+        _nodePixels.clear();
+        for (size_t i = 0; i < total; ++i) {
+            if (roi[i] == 0)
+                continue;
+            nodeIds[i] = _nodePixels.size();
+            _nodePixels.push_back(i);
+        }
+
+        unsigned nodes = _nodePixels.size();
+        _dataCosts.resize((size_t)nodes * _labels);
+        _edges.clear();
+
+        size_t strides[Dimension];
+        strides[0] = 1;
+        for (unsigned dim = 1; dim < Dimension; ++dim)
+            strides[dim] = strides[dim-1] * size[dim-1];
+
+        for (unsigned node = 0; node < nodes; ++node) {
+            size_t i = _nodePixels[node];
+            ImageIndex idx = roiImage->ComputeIndex(i);
+
+            for (LabelID label = 0; label < _labels; ++label)
+                _dataCosts[(size_t)node * _labels + label] =
+                    dataCostFunction->compute(idx, label);
+
+            // forward neighbours in all directions
+            for (unsigned dim = 0; dim < Dimension; ++dim) {
+                if (idx[dim] + 1 >= (long)size[dim])
+                    continue;
+                int neighbour = nodeIds[i + strides[dim]];
+                if (neighbour < 0)
+                    continue;
+
+                ImageIndex neighIndex = idx;
+                neighIndex[dim]++;
+
+                Edge edge;
+                edge.p = node;
+                edge.q = neighbour;
+                edge.weight = smoothnessCostFunction->compute(idx, neighIndex);
+                _edges.push_back(edge);
+            }
+        }
+    }
+
+
+
+    long long energy() {
+        long long e = 0;
+        for (unsigned node = 0; node < _nodeLabels.size(); ++node)
+            e += _dataCosts[(size_t)node * _labels + _nodeLabels[node]];
+        for (unsigned k = 0; k < _edges.size(); ++k)
+            if (_nodeLabels[_edges[k].p] != _nodeLabels[_edges[k].q])
+                e += _edges[k].weight;
+        return e;
+    }
+
+
+
+    /*
+    One expansion move on label alpha. Binary variable x_p = 1 (sink)
+    means that the pixel p switches to alpha. Pairwise terms are
+    decomposed as in [2]. Return true if the energy decreased.
+    */
+    bool expand(GraphType *gc, LabelID alpha, long long & currentEnergy) {
+
+        unsigned nodes = _nodeLabels.size();
+
+        gc->reset();
+        gc->add_node(nodes);
+
+        // cost of x_p = 0 (keep) and x_p = 1 (switch to alpha)
+        std::vector<EnergyTerm> & cost0 = _cost0;
+        std::vector<EnergyTerm> & cost1 = _cost1;
+        for (unsigned node = 0; node < nodes; ++node) {
+            cost0[node] = _dataCosts[(size_t)node * _labels + _nodeLabels[node]];
+            cost1[node] = _dataCosts[(size_t)node * _labels + alpha];
+        }
+
+        for (unsigned k = 0; k < _edges.size(); ++k) {
+            const Edge & edge = _edges[k];
+            LabelID fp = _nodeLabels[edge.p];
+            LabelID fq = _nodeLabels[edge.q];
+
+            EnergyTerm A = (fp != fq) ? edge.weight : 0;       // E(0,0)
+            EnergyTerm B = (fp != alpha) ? edge.weight : 0;    // E(0,1)
+            EnergyTerm C = (alpha != fq) ? edge.weight : 0;    // E(1,0)
+                                                               // E(1,1) = 0
+
+            // E = A + (C-A) x_p + (0-C) x_q + (B+C-A) (1-x_p) x_q
+            cost1[edge.p] += C - A;
+            cost1[edge.q] -= C;
+            if (B + C - A > 0)
+                gc->add_edge(edge.p, edge.q, B + C - A, 0);
+        }
+
+        for (unsigned node = 0; node < nodes; ++node) {
+            EnergyTerm m = std::min(cost0[node], cost1[node]);
+            // source capacity is paid for the sink (alpha), and vice versa
+            gc->add_tweights(node, cost1[node] - m, cost0[node] - m);
+        }
+
+        gc->maxflow();
+
+        std::copy(_nodeLabels.begin(), _nodeLabels.end(), _previousLabels.begin());
+        for (unsigned node = 0; node < nodes; ++node) {
+            if (gc->what_segment(node) == GraphType::SINK)
+                _nodeLabels[node] = alpha;
+        }
+
+        long long newEnergy = energy();
+        if (newEnergy < currentEnergy) {
+            currentEnergy = newEnergy;
+            return true;
+        }
+
+        std::copy(_previousLabels.begin(), _previousLabels.end(), _nodeLabels.begin());
+        return false;
+    }
+
+
+
+public:
+
+    /*
+    Expected peak memory of optimize in bytes for @nodes ROI pixels out of
+    @pixels pixels of the image and @labels labels: the graph (node and two
+    arcs per edge of Graph<int,int,int>, at most 3 edges per node), data
+    costs, edges, per-node labels, pixels and expansion scratch, the node
+    ids over the whole image and the output image.
+    */
+    static double expectedMemoryInBytes(size_t nodes, size_t pixels, unsigned labels) {
+        bool is32bit = (sizeof(void*) == 4);
+        double perNode =
+            ( is32bit ? 124 : 232 )                 // graph
+            + labels * sizeof(EnergyTerm)           // _dataCosts
+            + 3 * sizeof(Edge)                      // _edges
+            + sizeof(size_t)                        // _nodePixels
+            + 2 * sizeof(LabelID)                   // _nodeLabels, _previousLabels
+            + 2 * sizeof(EnergyTerm);               // _cost0, _cost1
+        double perPixel =
+            sizeof(int)                             // node ids
+            + sizeof(LabelID);                      // output
+        return perNode * nodes + perPixel * pixels;
+    }
+
+
+
+    /*
+    Compute labelling of the ROI pixels with @labels labels.
+
+    Pixels in the ROI image should be as follows:
+        0 - Pixels outside ROI, these pixels are ingored
+        1 - Pixels within ROI
+
+    The initial labelling (values 1..labels within ROI) is updated by
+    expansion moves until no move decreases the energy. The output has
+    labels 1..labels within ROI and 0 outside.
+    */
+    LabelIdImagePointer optimize(
+        LabelIdImagePointer roiImage,
+        LabelIdImagePointer initialLabels,
+        unsigned labels,
+        DataCostFunction * dataCostFunction,
+        SmoothnessCostFunction * smoothnessCostFunction,
+        unsigned maxCycles = 5
+    ) {
+        _labels = labels;
+
+        buildNodesAndCosts(roiImage, dataCostFunction, smoothnessCostFunction);
+
+        unsigned nodes = _nodePixels.size();
+        log("Alpha-expansion, %d labels, %d nodes, %d edges")
+            % labels % nodes % _edges.size();
+
+        const LabelID *initial = initialLabels->GetBufferPointer();
+        _nodeLabels.resize(nodes);
+        for (unsigned node = 0; node < nodes; ++node) {
+            LabelID label = initial[_nodePixels[node]];
+            assert(label >= 1 && label <= labels);
+            _nodeLabels[node] = label - 1;
+        }
+
+        _cost0.resize(nodes);
+        _cost1.resize(nodes);
+        _previousLabels.resize(nodes);
+
+        GraphType *gc = new GraphType(nodes, _edges.size());
+
+        long long currentEnergy = energy();
+        for (unsigned cycle = 0; cycle < maxCycles; ++cycle) {
+            bool improved = false;
+            for (LabelID alpha = 0; alpha < labels; ++alpha)
+                improved = expand(gc, alpha, currentEnergy) || improved;
+
+            log("Expansion cycle %d, energy %d") % cycle % currentEnergy;
+            if (!improved)
+                break;
+        }
+
+        delete gc;
+
+        // output labelling
+        LabelIdImagePointer output = ImageUtils<LabelIdImage>::createEmpty(
+            roiImage->GetLargestPossibleRegion().GetSize());
+        output->FillBuffer(0);
+        LabelID *out = output->GetBufferPointer();
+        for (unsigned node = 0; node < nodes; ++node)
+            out[_nodePixels[node]] = _nodeLabels[node] + 1;
+
+        return output;
+    }
+
+};
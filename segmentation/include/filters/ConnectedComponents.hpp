@@ -0,0 +1,390 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <cstddef>
+
+#include "ImageUtils.hpp"
+#include "ParallelUtils.hpp"
+#include "Globals.hpp"
+
+/*
+
+Connected components of the nonzero pixels of a 3D image (6-connectivity),
+the same as itk::ConnectedComponentImageFilter with the default settings:
+components are labelled 1..N in the raster order of their first pixel.
+
+The image is split into slabs of slices, one per thread. Each slab is
+labelled by a union-find over pixel indices stored directly in the output
+buffer (parent index + 1, 0 for the background), the trees are linked so
+that the root of a component is its first pixel. The slabs are merged
+along their boundary slices (only one slice per slab, so this is done
+serially), the trees are flattened slab by slab and the final labels are
+assigned in parallel from the number of roots in the preceding slabs.
+The number of pixels and the bounding box of each component are collected
+in the same pass.
+
+Options:
+
+    sortBySize - relabel the components by size (largest = 1), ties by
+                 the original label, as itk::RelabelComponentImageFilter
+
+*/
+template<class InputImage>
+class ConnectedComponents {
+
+public:
+
+    typedef typename InputImage::Pointer InputImagePointer;
+    typedef typename InputImage::PixelType InputPixel;
+    typedef unsigned Label;
+
+    struct Component {
+
+        // number of pixels in the component
+        unsigned count;
+
+        // bounding box, valid if count > 0
+        ImageIndex lower, upper;
+
+        Component() : count(0) {}
+
+        void addPixel(long x, long y, long z) {
+            const long coords[3] = { x, y, z };
+            for (unsigned dim = 0; dim < 3; ++dim) {
+                if (count == 0 || coords[dim] < lower[dim]) lower[dim] = coords[dim];
+                if (count == 0 || coords[dim] > upper[dim]) upper[dim] = coords[dim];
+            }
+            count++;
+        }
+
+        void merge(const Component & other) {
+            if (other.count == 0)
+                return;
+            if (count == 0) {
+                *this = other;
+                return;
+            }
+            for (unsigned dim = 0; dim < 3; ++dim) {
+                lower[dim] = std::min(lower[dim], other.lower[dim]);
+                upper[dim] = std::max(upper[dim], other.upper[dim]);
+            }
+            count += other.count;
+        }
+    };
+
+
+private:
+
+    bool _sortBySize;
+
+    // components indexed by label, entry 0 (background) is unused
+    std::vector<Component> _components;
+
+    // the first slice of each slab, and the depth as the last entry
+    std::vector<long> _slabs;
+
+
+
+    // root of the tree containing i, with path halving
+    static size_t find(Label *parent, size_t i) {
+        while (parent[i] - 1 != i) {
+            parent[i] = parent[parent[i] - 1];
+            i = parent[i] - 1;
+        }
+        return i;
+    }
+
+
+
+    // join the trees of a and b, the smaller root becomes the root
+    static void join(Label *parent, size_t a, size_t b) {
+        size_t ra = find(parent, a);
+        size_t rb = find(parent, b);
+        if (ra < rb)
+            parent[rb] = ra + 1;
+        else if (rb < ra)
+            parent[ra] = rb + 1;
+    }
+
+
+
+    void splitIntoSlabs(long depth) {
+        long nSlabs = std::min<long>(ParallelUtils::numberOfThreads(), depth);
+        long slabDepth = (depth + nSlabs - 1) / nSlabs;
+        _slabs.clear();
+        for (long z = 0; z < depth; z += slabDepth)
+            _slabs.push_back(z);
+        _slabs.push_back(depth);
+    }
+
+
+
+    void sortComponentsBySize(Label *out, size_t total) {
+        Label n = _components.size() - 1;
+
+        std::vector<Label> order(n);
+        for (Label l = 0; l < n; ++l)
+            order[l] = l + 1;
+        std::stable_sort(order.begin(), order.end(),
+            [&](Label a, Label b) {
+                return _components[a].count > _components[b].count;
+            });
+
+        std::vector<Label> newLabel(n + 1, 0);
+        std::vector<Component> sorted(n + 1);
+        for (Label l = 0; l < n; ++l) {
+            newLabel[order[l]] = l + 1;
+            sorted[l + 1] = _components[order[l]];
+        }
+        _components.swap(sorted);
+
+        ParallelUtils::parallelFor(0, total,
+            [&](size_t from, size_t to, unsigned) {
+                for (size_t i = from; i < to; ++i)
+                    out[i] = newLabel[out[i]];
+            });
+    }
+
+
+
+public:
+
+    // constructor
+    ConnectedComponents() : _sortBySize(false) {}
+
+    void setSortBySize(bool s)      { _sortBySize = s; }
+
+    // components of the last computed image indexed by label (0 unused)
+    const std::vector<Component> & getComponents() const {
+        return _components;
+    }
+
+    unsigned getNumberOfComponents() const {
+        return _components.size() - 1;
+    }
+
+
+
+    /*
+    Input image (object = nonzero pixels),
+    Output labels of the connected components, 0 for the background
+    */
+    UIntImagePtr compute(InputImagePointer image) {
+
+        ImageSize size = image->GetLargestPossibleRegion().GetSize();
+        const long w = size[0], h = size[1], d = size[2];
+        const size_t wh = (size_t)w * h;
+        const size_t total = wh * d;
+
+        UIntImagePtr labelImg = ImageUtils<UIntImage>::createEmpty(size);
+        labelImg->SetOrigin(image->GetOrigin());
+        labelImg->SetSpacing(image->GetSpacing());
+        labelImg->SetDirection(image->GetDirection());
+
+        const InputPixel *in = image->GetBufferPointer();
+        Label *out = labelImg->GetBufferPointer();
+
+        _components.assign(1, Component());
+        if (total == 0)
+            return labelImg;
+
+        splitIntoSlabs(d);
+        const unsigned nSlabs = _slabs.size() - 1;
+
+        // label each slab independently
+        ParallelUtils::parallelTasks(nSlabs,
+            [&](size_t s, unsigned) {
+                for (long z = _slabs[s]; z < _slabs[s+1]; ++z)
+                    for (long y = 0; y < h; ++y)
+                        for (long x = 0; x < w; ++x) {
+                            size_t i = x + y * w + z * wh;
+                            if (in[i] == 0) {
+                                out[i] = 0;
+                                continue;
+                            }
+                            out[i] = i + 1;
+                            if (x > 0 && in[i - 1] != 0)
+                                join(out, i, i - 1);
+                            if (y > 0 && in[i - w] != 0)
+                                join(out, i, i - w);
+                            if (z > _slabs[s] && in[i - wh] != 0)
+                                join(out, i, i - wh);
+                        }
+            });
+
+        // merge slabs along their first slices
+        for (unsigned s = 1; s < nSlabs; ++s) {
+            size_t first = _slabs[s] * wh;
+            for (size_t i = first; i < first + wh; ++i) {
+                if (in[i] != 0 && in[i - wh] != 0)
+                    join(out, i, i - wh);
+            }
+        }
+
+        /*
+        Flatten the trees. Parents always precede their children, so
+        within a slab every pixel is first linked to the root of its tree
+        inside the slab (local root). Local roots linked to a preceding
+        slab are then resolved serially in the slab order and finally all
+        pixels are linked to the resolved roots.
+        */
+        std::vector<std::vector<size_t> > linkedRoots(nSlabs);
+
+        ParallelUtils::parallelTasks(nSlabs,
+            [&](size_t s, unsigned) {
+                size_t begin = _slabs[s] * wh;
+                size_t end = _slabs[s+1] * wh;
+                for (size_t i = begin; i < end; ++i) {
+                    if (out[i] == 0)
+                        continue;
+                    size_t p = out[i] - 1;
+                    if (p == i)
+                        continue;
+                    if (p < begin) {
+                        linkedRoots[s].push_back(i);
+                        continue;
+                    }
+                    // p precedes i, so it is already linked to its local root
+                    size_t q = out[p] - 1;
+                    out[i] = (q < begin ? p : q) + 1;
+                }
+            });
+
+        for (unsigned s = 1; s < nSlabs; ++s) {
+            for (size_t k = 0; k < linkedRoots[s].size(); ++k) {
+                size_t r = linkedRoots[s][k];
+                size_t q = out[out[r] - 1] - 1;
+                out[r] = out[q];
+            }
+        }
+
+        // roots of each slab, in raster order
+        std::vector<std::vector<size_t> > roots(nSlabs);
+
+        ParallelUtils::parallelTasks(nSlabs,
+            [&](size_t s, unsigned) {
+                size_t begin = _slabs[s] * wh;
+                size_t end = _slabs[s+1] * wh;
+                for (size_t i = begin; i < end; ++i) {
+                    if (out[i] == 0)
+                        continue;
+                    size_t p = out[i] - 1;
+                    if (p == i)
+                        roots[s].push_back(i);
+                    else if (p >= begin)
+                        out[i] = out[p];
+                }
+            });
+
+        // labels of the roots of slab s are base[s]+1, ..., base[s+1]
+        std::vector<Label> base(nSlabs + 1, 0);
+        for (unsigned s = 0; s < nSlabs; ++s)
+            base[s+1] = base[s] + roots[s].size();
+
+        ParallelUtils::parallelTasks(nSlabs,
+            [&](size_t s, unsigned) {
+                for (size_t k = 0; k < roots[s].size(); ++k)
+                    out[roots[s][k]] = base[s] + k + 1;
+            });
+
+        /*
+        Label the other pixels by the label of their root and collect the
+        components. Components with the root in the slab are stored
+        densely, the others (which must cross the first slice of the slab)
+        in a map.
+        */
+        std::vector<std::vector<Component> > local(nSlabs);
+        std::vector<std::unordered_map<Label, Component> > crossing(nSlabs);
+
+        ParallelUtils::parallelTasks(nSlabs,
+            [&](size_t s, unsigned) {
+                local[s].resize(roots[s].size());
+                size_t nextRoot = 0;
+                Label lastLabel = 0;
+                Component *last = 0;
+
+                for (long z = _slabs[s]; z < _slabs[s+1]; ++z)
+                    for (long y = 0; y < h; ++y)
+                        for (long x = 0; x < w; ++x) {
+                            size_t i = x + y * w + z * wh;
+                            if (out[i] == 0)
+                                continue;
+
+                            if (nextRoot < roots[s].size() && roots[s][nextRoot] == i)
+                                nextRoot++;
+                            else
+                                out[i] = out[out[i] - 1];
+
+                            Label label = out[i];
+                            if (label != lastLabel) {
+                                lastLabel = label;
+                                last = (label > base[s]) ?
+                                    &local[s][label - base[s] - 1] :
+                                    &crossing[s][label];
+                            }
+                            last->addPixel(x, y, z);
+                        }
+            });
+
+        _components.resize(base[nSlabs] + 1);
+        for (unsigned s = 0; s < nSlabs; ++s) {
+            for (size_t k = 0; k < local[s].size(); ++k)
+                _components[base[s] + k + 1].merge(local[s][k]);
+            typename std::unordered_map<Label, Component>::const_iterator it;
+            for (it = crossing[s].begin(); it != crossing[s].end(); ++it)
+                _components[it->first].merge(it->second);
+        }
+
+        if (_sortBySize)
+            sortComponentsBySize(out, total);
+
+        return labelImg;
+    }
+
+
+
+    /*
+    Binary mask of the largest connected component of the nonzero pixels
+    (the first one in the raster order if there are more of the same
+    size). Pixels of the component get @inside, all other pixels @outside.
+    Same as thresholding the output of connectedComponents and
+    relabelComponents to [1,1], without sorting and relabelling.
+    */
+    template<class MaskImage>
+    static typename MaskImage::Pointer largestComponent(
+        InputImagePointer image,
+        typename MaskImage::PixelType inside = 1,
+        typename MaskImage::PixelType outside = 0
+    ) {
+        ConnectedComponents cc;
+        UIntImagePtr labels = cc.compute(image);
+
+        Label largest = 0;
+        for (Label l = 1; l < cc._components.size(); ++l) {
+            if (largest == 0 ||
+                    cc._components[l].count > cc._components[largest].count)
+                largest = l;
+        }
+
+        typename MaskImage::Pointer mask = ImageUtils<MaskImage>::createEmpty(
+            image->GetLargestPossibleRegion().GetSize());
+        mask->SetOrigin(image->GetOrigin());
+        mask->SetSpacing(image->GetSpacing());
+        mask->SetDirection(image->GetDirection());
+
+        const Label *label = labels->GetBufferPointer();
+        typename MaskImage::PixelType *out = mask->GetBufferPointer();
+        size_t total = image->GetLargestPossibleRegion().GetNumberOfPixels();
+
+        ParallelUtils::parallelFor(0, total,
+            [&](size_t from, size_t to, unsigned) {
+                for (size_t i = from; i < to; ++i)
+                    out[i] = (largest != 0 && label[i] == largest) ? inside : outside;
+            });
+
+        return mask;
+    }
+
+};
@@ -0,0 +1,417 @@
+#pragma once
+
+#include <vector>
+#include <limits>
+#include <cmath>
+#include <cstddef>
+#include <type_traits>
+
+#include "ImageUtils.hpp"
+#include "ParallelUtils.hpp"
+#include "Globals.hpp"
+
+/*
+
+Exact Euclidean Distance Transform computed by three separable 1D passes
+(along x, y and z) of the lower envelope of parabolas, as described in:
+
+ [1] Distance Transforms of Sampled Functions,
+     Pedro F. Felzenszwalb, Daniel P. Huttenlocher,
+     Theory of Computing, 2012
+
+Each pass is independent for each scanline, so the lines are split between
+threads. Distances are measured between voxel centers, in physical units if
+image spacing is used (default), otherwise in voxels.
+
+Object voxels are voxels with a nonzero label (or with the given object
+label, see setObjectLabel). Options:
+
+    signed      - object voxels get minus the distance to the nearest
+                  background voxel, background voxels the distance to the
+                  nearest object voxel (both sides computed in the same passes)
+    squared     - output squared distances (no square root)
+    propagation - label of the nearest object voxel for every voxel
+                  (see setPropagation), ties are broken arbitrarily
+
+*/
+template<class LabelImage, class DistanceImage = FloatImage>
+class EuclideanDistanceTransform {
+
+private:
+
+    typedef typename DistanceImage::Pointer DistanceImagePointer;
+    typedef typename LabelImage::Pointer LabelImagePointer;
+
+    typedef typename LabelImage::PixelType Label;
+    typedef typename DistanceImage::PixelType Distance;
+
+
+    bool _useImageSpacing;
+    bool _signed;
+    bool _squared;
+    bool _useObjectLabel;
+    Label _objectLabel;
+    bool _propagate;
+    LabelImagePointer _propagationImage;
+    float _maximumDistance;
+
+    int _size[3];
+    double _spacing[3];
+    ptrdiff_t _stride[3];
+
+
+
+    /*
+    Lower envelope of parabolas along one scanline of n samples with
+    the given spacing:
+
+        f_out(p) = min_q ( (p-q)^2 * spacing^2 + f(q) )
+
+    Samples with f(q) = infinity are not part of the envelope. If labels
+    is given, it is updated with the label of the minimizing sample.
+    Scratch arrays v, z, fLine, labelLine must hold n (resp. n+1) values.
+    */
+    static void envelope(
+        float *f, ptrdiff_t stride, int n, double spacing,
+        Label *labels,
+        std::vector<int> &v, std::vector<double> &z,
+        std::vector<float> &fLine, std::vector<Label> &labelLine
+    ) {
+        const float inf = std::numeric_limits<float>::infinity();
+        const double s2 = spacing * spacing;
+
+        // copy the line, build the envelope from finite samples
+        int k = -1;
+        for (int q = 0; q < n; ++q) {
+            fLine[q] = f[q * stride];
+            if (labels)
+                labelLine[q] = labels[q * stride];
+
+            if (fLine[q] == inf)
+                continue;
+
+            double fq = fLine[q] + s2 * q * q;
+            while (k >= 0) {
+                int r = v[k];
+                double sIntersect =
+                    (fq - (fLine[r] + s2 * r * r)) / (2.0 * s2 * (q - r));
+                if (sIntersect > z[k])
+                    break;
+                k--;
+            }
+            k++;
+            v[k] = q;
+            z[k] = (k == 0) ? -inf : (fq - (fLine[v[k-1]] + s2 * v[k-1] * v[k-1]))
+                / (2.0 * s2 * (q - v[k-1]));
+            z[k+1] = inf;
+        }
+
+        // no object on this line, leave it untouched
+        if (k < 0)
+            return;
+
+        // evaluate the envelope
+        int j = 0;
+        for (int q = 0; q < n; ++q) {
+            while (z[j+1] < q)
+                j++;
+            int r = v[j];
+            double d = q - r;
+            f[q * stride] = (float)(s2 * d * d + fLine[r]);
+            if (labels)
+                labels[q * stride] = labelLine[r];
+        }
+    }
+
+
+
+    // one pass along the given axis for the images f and g (if not null)
+    void pass(unsigned axis, float *f, float *g, Label *labels) {
+
+        // lines along the axis are enumerated by (a,b) over the two
+        // remaining axes; threads split the outer one
+        unsigned axisA = (axis == 2) ? 1 : 2;
+        unsigned axisB = (axis == 0) ? 1 : 0;
+
+        const int n = _size[axis];
+        const ptrdiff_t stride = _stride[axis];
+        const double spacing = _spacing[axis];
+
+        ParallelUtils::parallelFor(0, _size[axisA],
+            [&](size_t from, size_t to, unsigned) {
+                std::vector<int> v(n);
+                std::vector<double> z(n + 1);
+                std::vector<float> fLine(n);
+                std::vector<Label> labelLine(labels ? n : 0);
+
+                for (int a = from; a < (int)to; ++a) {
+                    for (int b = 0; b < _size[axisB]; ++b) {
+                        ptrdiff_t start = a * _stride[axisA] + b * _stride[axisB];
+                        envelope(f + start, stride, n, spacing,
+                            labels ? labels + start : 0, v, z, fLine, labelLine);
+                        if (g)
+                            envelope(g + start, stride, n, spacing,
+                                0, v, z, fLine, labelLine);
+                    }
+                }
+            });
+    }
+
+
+
+    // empty image with the geometry of the input (FilterUtils uses this
+    // class, so FilterUtils::createEmptyFrom cannot be used here)
+    template<class Image>
+    static typename Image::Pointer createEmptyFrom(LabelImagePointer input) {
+        typename Image::Pointer output = ImageUtils<Image>::createEmpty(
+            input->GetLargestPossibleRegion().GetSize());
+        output->SetOrigin(input->GetOrigin());
+        output->SetSpacing(input->GetSpacing());
+        output->SetDirection(input->GetDirection());
+        output->FillBuffer(0);
+        return output;
+    }
+
+
+
+    bool isObject(Label label) {
+        return _useObjectLabel ? (label == _objectLabel) : (label != 0);
+    }
+
+
+
+    /*
+    Bounding box [lower,upper] of the voxels whose distance has to be
+    computed. Without a maximum distance this is the whole image. With it,
+    this is the bounding box of the object (unsigned) or of the object
+    voxels with a background 6-neighbour (signed), padded by the maximum
+    distance. All other voxels are farther than the maximum distance from
+    the object (resp. its boundary). Returns false if there is no such voxel.
+    */
+    bool getBandBoundingBox(
+        const Label *label, const int size[3], int lower[3], int upper[3]
+    ) {
+        if (_maximumDistance <= 0) {
+            for (unsigned dim = 0; dim < 3; ++dim) {
+                lower[dim] = 0;
+                upper[dim] = size[dim] - 1;
+            }
+            return true;
+        }
+
+        const int w = size[0], h = size[1], d = size[2];
+        const ptrdiff_t wh = (ptrdiff_t)w * h;
+
+        int lo[3] = { w, h, d };
+        int hi[3] = { -1, -1, -1 };
+
+        for (int k = 0; k < d; ++k)
+            for (int j = 0; j < h; ++j)
+                for (int i = 0; i < w; ++i) {
+                    ptrdiff_t idx = i + j * w + k * wh;
+                    if (!isObject(label[idx]))
+                        continue;
+
+                    if (_signed) {
+                        bool boundary =
+                            (i > 0   && !isObject(label[idx - 1]))  ||
+                            (i < w-1 && !isObject(label[idx + 1]))  ||
+                            (j > 0   && !isObject(label[idx - w]))  ||
+                            (j < h-1 && !isObject(label[idx + w]))  ||
+                            (k > 0   && !isObject(label[idx - wh])) ||
+                            (k < d-1 && !isObject(label[idx + wh]));
+                        if (!boundary)
+                            continue;
+                    }
+
+                    lo[0] = std::min(lo[0], i); hi[0] = std::max(hi[0], i);
+                    lo[1] = std::min(lo[1], j); hi[1] = std::max(hi[1], j);
+                    lo[2] = std::min(lo[2], k); hi[2] = std::max(hi[2], k);
+                }
+
+        if (hi[0] < 0)
+            return false;
+
+        // the nearest background voxel of an object voxel is one voxel
+        // beyond the object boundary
+        int extra = _signed ? 1 : 0;
+        for (unsigned dim = 0; dim < 3; ++dim) {
+            int pad = (int)std::ceil(_maximumDistance / _spacing[dim]) + extra;
+            lower[dim] = std::max(0, lo[dim] - pad);
+            upper[dim] = std::min(size[dim] - 1, hi[dim] + pad);
+        }
+        return true;
+    }
+
+
+
+public:
+
+    // constructor
+    EuclideanDistanceTransform() :
+        _useImageSpacing(true), _signed(false), _squared(false),
+        _useObjectLabel(false), _objectLabel(0), _propagate(false),
+        _maximumDistance(0)
+    {}
+
+    void setUseImageSpacing(bool use)   { _useImageSpacing = use; }
+    void setSigned(bool s)              { _signed = s; }
+    void setSquaredDistance(bool s)     { _squared = s; }
+
+    // only voxels with this label are considered to be the object
+    void setObjectLabel(Label label) {
+        _useObjectLabel = true;
+        _objectLabel = label;
+    }
+
+    // compute the label of the nearest object voxel for every voxel
+    void setPropagation(bool p)         { _propagate = p; }
+
+    /*
+    Compute the distance only within a narrow band: distances are clamped
+    to [-maxDistance, maxDistance] and only voxels in the bounding box of
+    the band are processed. Propagated labels are 0 outside this box.
+    Non-positive value (default) means no band.
+    */
+    void setMaximumDistance(float maxDistance) { _maximumDistance = maxDistance; }
+
+    LabelImagePointer getPropagationImage() {
+        return _propagationImage;
+    }
+
+
+
+
+    /*
+    Input label image (object = nonzero or the object label),
+    Output distance to the object as a floating point image
+    (infinity if there is no object in the image and no band is set)
+    */
+    DistanceImagePointer compute(LabelImagePointer labelImg) {
+
+        typename LabelImage::SizeType size =
+            labelImg->GetLargestPossibleRegion().GetSize();
+        typename LabelImage::SpacingType spacing = labelImg->GetSpacing();
+        int imageSize[3];
+        for (unsigned dim = 0; dim < 3; ++dim) {
+            imageSize[dim] = size[dim];
+            _spacing[dim] = _useImageSpacing ? spacing[dim] : 1.0;
+        }
+        const ptrdiff_t imageW = imageSize[0];
+        const ptrdiff_t imageWH = imageW * imageSize[1];
+        const size_t imageTotal = (size_t)imageWH * imageSize[2];
+
+        const float inf = std::numeric_limits<float>::infinity();
+        const Label *label = labelImg->GetBufferPointer();
+
+        DistanceImagePointer distanceImg =
+            createEmptyFrom<DistanceImage>(labelImg);
+        Distance *dist = distanceImg->GetBufferPointer();
+
+        Label *propagation = 0;
+        if (_propagate) {
+            _propagationImage =
+                createEmptyFrom<LabelImage>(labelImg);
+            propagation = _propagationImage->GetBufferPointer();
+        }
+
+        // value of voxels beyond the band
+        const bool band = (_maximumDistance > 0);
+        const float far = !band ? inf :
+            (_squared ? _maximumDistance * _maximumDistance : _maximumDistance);
+
+        int lower[3], upper[3];
+        if (!getBandBoundingBox(label, imageSize, lower, upper)) {
+            for (size_t i = 0; i < imageTotal; ++i)
+                dist[i] = (_signed && isObject(label[i])) ? -far : far;
+            return distanceImg;
+        }
+
+        // the distance is computed within the box [lower,upper]
+        for (unsigned dim = 0; dim < 3; ++dim)
+            _size[dim] = upper[dim] - lower[dim] + 1;
+        _stride[0] = 1;
+        _stride[1] = _size[0];
+        _stride[2] = (ptrdiff_t)_size[0] * _size[1];
+        const size_t total = (size_t)_stride[2] * _size[2];
+        const bool wholeImage = (total == imageTotal);
+
+        if (!wholeImage) {
+            for (size_t i = 0; i < imageTotal; ++i)
+                dist[i] = (_signed && isObject(label[i])) ? -far : far;
+        }
+
+        // squared distance to the object, computed in the output buffer
+        // if the output is a float image covering the box
+        std::vector<float> fStorage;
+        float *f;
+        if (wholeImage && std::is_same<Distance, float>::value) {
+            f = reinterpret_cast<float *>(dist);
+        } else {
+            fStorage.resize(total);
+            f = &fStorage[0];
+        }
+
+        // squared distance to the background (signed only)
+        std::vector<float> g(_signed ? total : 0);
+
+        std::vector<Label> labelStorage;
+        Label *labels = 0;
+        if (_propagate) {
+            if (wholeImage) {
+                labels = propagation;
+            } else {
+                labelStorage.resize(total);
+                labels = &labelStorage[0];
+            }
+        }
+
+        // index of the first voxel of the box in the image
+        const ptrdiff_t boxStart =
+            lower[0] + lower[1] * imageW + lower[2] * imageWH;
+
+        for (int k = 0; k < _size[2]; ++k)
+            for (int j = 0; j < _size[1]; ++j) {
+                const Label *row = label + boxStart + j * imageW + k * imageWH;
+                size_t boxRow = j * _stride[1] + k * _stride[2];
+                for (int i = 0; i < _size[0]; ++i) {
+                    bool object = isObject(row[i]);
+                    f[boxRow + i] = object ? 0 : inf;
+                    if (_signed)
+                        g[boxRow + i] = object ? inf : 0;
+                    if (_propagate)
+                        labels[boxRow + i] = object ? row[i] : 0;
+                }
+            }
+
+        for (unsigned axis = 0; axis < 3; ++axis) {
+            pass(axis, f, _signed ? &g[0] : 0, labels);
+        }
+
+        ParallelUtils::parallelFor(0, _size[2],
+            [&](size_t from, size_t to, unsigned) {
+                for (int k = from; k < (int)to; ++k)
+                    for (int j = 0; j < _size[1]; ++j) {
+                        ptrdiff_t imageRow = boxStart + j * imageW + k * imageWH;
+                        size_t boxRow = j * _stride[1] + k * _stride[2];
+                        for (int i = 0; i < _size[0]; ++i) {
+                            size_t b = boxRow + i;
+                            float d;
+                            if (_signed && isObject(label[imageRow + i])) {
+                                d = _squared ? g[b] : std::sqrt(g[b]);
+                                d = -std::min(d, far);
+                            } else {
+                                d = _squared ? f[b] : std::sqrt(f[b]);
+                                d = std::min(d, far);
+                            }
+                            dist[imageRow + i] = (Distance) d;
+                            if (_propagate && !wholeImage)
+                                propagation[imageRow + i] = labels[b];
+                        }
+                    }
+            });
+
+        return distanceImg;
+    }
+
+};
@@ -0,0 +1,176 @@
+#pragma once
+
+#include "itkImage.h"
+
+#include <vector>
+#include <algorithm> //max,min
+#include <cmath>
+
+#include "ParallelUtils.hpp"
+#include "Globals.hpp"
+
+
+/*
+Edge feature image of a CT image for the geodesic active contours:
+
+    output = exp( -|grad (G * ct)| / edgeScale )
+
+where G is a gaussian with the given sigma in physical units. The gradient
+is computed by separable convolutions with sampled gaussian and gaussian
+derivative kernels (radius 4 sigma, derivatives in physical units, clamped
+borders), as a replacement of itk::GradientMagnitudeRecursiveGaussianImageFilter
+followed by the exponential mapping.
+
+The short CT is read directly and the only volume allocated is the output.
+Slices are independent once the z pass is done per slice: each thread
+streams over a slab of consecutive slices, computes the z pass of a slice
+from the input slices around it into slice buffers, then the y and x
+passes and the mapping, and writes the feature values of the slice.
+*/
+class GradientFeatureFilter {
+
+public:
+
+    GradientFeatureFilter() :
+        m_sigma(1.0), m_edgeScale(35.0) {}
+
+    void SetImage(ShortImagePtr image)      { m_image = image; }
+    void SetSigma(double sigma)             { m_sigma = sigma; }
+    void SetEdgeScale(float scale)          { m_edgeScale = scale; }
+
+    FloatImagePtr GetOutput()               { return m_output; }
+
+    void Update() {
+
+        ImageSize size = m_image->GetLargestPossibleRegion().GetSize();
+        const int w = size[0], h = size[1], d = size[2];
+        const size_t wh = (size_t)w * h;
+
+        m_output = FloatImage::New();
+        m_output->CopyInformation(m_image);
+        m_output->SetRegions(m_image->GetLargestPossibleRegion());
+        m_output->Allocate();
+
+        // gaussian and derivative kernels along x, y, z
+        std::vector<float> smooth[3], derivative[3];
+        int radius[3];
+        for (unsigned dim = 0; dim < 3; ++dim) {
+            createKernels(dim, smooth[dim], derivative[dim]);
+            radius[dim] = smooth[dim].size() / 2;
+        }
+
+        const short *ct = m_image->GetBufferPointer();
+        float *out = m_output->GetBufferPointer();
+
+        ParallelUtils::parallelFor(0, d,
+            [&](size_t from, size_t to, unsigned) {
+
+                // z pass: smoothed and derivative
+                std::vector<float> sz(wh), dz(wh);
+                // y pass: smoothed(sz), derivative(sz), smoothed(dz)
+                std::vector<float> syz(wh), dyz(wh), sdz(wh);
+                // x pass: padded rows of the y pass results
+                std::vector<float> lineS(w + 2*radius[0]);
+                std::vector<float> lineD(w + 2*radius[0]);
+                std::vector<float> lineSD(w + 2*radius[0]);
+
+                for (int k = from; k < (int)to; ++k) {
+
+                    std::fill(sz.begin(), sz.end(), 0.0f);
+                    std::fill(dz.begin(), dz.end(), 0.0f);
+                    for (int t = -radius[2]; t <= radius[2]; ++t) {
+                        int kk = std::min(d-1, std::max(0, k+t));
+                        const short *src = ct + kk*wh;
+                        const float cs = smooth[2][t + radius[2]];
+                        const float cd = derivative[2][t + radius[2]];
+                        for (size_t i = 0; i < wh; ++i) {
+                            sz[i] += cs * src[i];
+                            dz[i] += cd * src[i];
+                        }
+                    }
+
+                    std::fill(syz.begin(), syz.end(), 0.0f);
+                    std::fill(dyz.begin(), dyz.end(), 0.0f);
+                    std::fill(sdz.begin(), sdz.end(), 0.0f);
+                    for (int j = 0; j < h; ++j) {
+                        float *rowS = &syz[(size_t)j*w];
+                        float *rowD = &dyz[(size_t)j*w];
+                        float *rowSD = &sdz[(size_t)j*w];
+                        for (int t = -radius[1]; t <= radius[1]; ++t) {
+                            int jj = std::min(h-1, std::max(0, j+t));
+                            const float *srcS = &sz[(size_t)jj*w];
+                            const float *srcD = &dz[(size_t)jj*w];
+                            const float cs = smooth[1][t + radius[1]];
+                            const float cd = derivative[1][t + radius[1]];
+                            for (int i = 0; i < w; ++i) {
+                                rowS[i] += cs * srcS[i];
+                                rowD[i] += cd * srcS[i];
+                                rowSD[i] += cs * srcD[i];
+                            }
+                        }
+                    }
+
+                    // x pass, gradient magnitude and the mapping
+                    for (int j = 0; j < h; ++j) {
+                        // rows with clamped borders, line[i + radius] = row[i]
+                        for (int i = -radius[0]; i < w + radius[0]; ++i) {
+                            size_t ii = (size_t)j*w + std::min(w-1, std::max(0, i));
+                            lineS[i + radius[0]] = syz[ii];
+                            lineD[i + radius[0]] = dyz[ii];
+                            lineSD[i + radius[0]] = sdz[ii];
+                        }
+
+                        float *dst = out + k*wh + (size_t)j*w;
+                        for (int i = 0; i < w; ++i) {
+                            float gx = 0, gy = 0, gz = 0;
+                            for (int t = 0; t <= 2*radius[0]; ++t) {
+                                gx += derivative[0][t] * lineS[i + t];
+                                gy += smooth[0][t] * lineD[i + t];
+                                gz += smooth[0][t] * lineSD[i + t];
+                            }
+                            float g = std::sqrt(gx*gx + gy*gy + gz*gz);
+                            dst[i] = std::exp(-g / m_edgeScale);
+                        }
+                    }
+                }
+            });
+    }
+
+
+private:
+
+    ShortImagePtr m_image;
+    FloatImagePtr m_output;
+    double m_sigma;
+    float m_edgeScale;
+
+
+
+    /*
+    Sampled gaussian along the given axis normalized to sum 1, and the
+    derivative kernel normalized so that it gives 1 on a unit ramp (per
+    physical unit). Kernels are applied as sum_t kernel[t] * f(x+t).
+    */
+    void createKernels(unsigned dim, std::vector<float> & smooth, std::vector<float> & derivative) {
+        double spacing = m_image->GetSpacing()[dim];
+        int radius = std::max(1, (int)ceil(4 * m_sigma / spacing));
+
+        smooth.resize(2*radius + 1);
+        derivative.resize(2*radius + 1);
+
+        double sum = 0, ramp = 0;
+        for (int t = -radius; t <= radius; ++t) {
+            double x = t * spacing;
+            double g = exp(-x*x / (2 * m_sigma * m_sigma));
+            smooth[t + radius] = g;
+            derivative[t + radius] = x * g;
+            sum += g;
+            ramp += x * x * g;
+        }
+        for (int t = -radius; t <= radius; ++t) {
+            smooth[t + radius] /= sum;
+            derivative[t + radius] /= ramp;
+        }
+    }
+
+};
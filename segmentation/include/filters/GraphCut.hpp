@@ -76,6 +76,23 @@ private:
     /* Number of neighbors */
     unsigned int _totalNeighbors;
 
+    /*
+    Members of the incremental segmentation (public buildGraph,
+    updateDataCosts and solve), not allocated by optimize.
+    */
+
+    /* Current data costs of each node, _dataCosts[2 * pixelId + label] */
+    std::vector<EnergyTerm> _dataCosts;
+
+    /* True once the max flow was computed, later solves reuse the search trees */
+    bool _solved;
+
+    /* Offset of the pixel of each node, to update the labelling of changed nodes */
+    std::vector<size_t> _nodePixels;
+
+    /* Nodes which may have changed their segment in the last solve */
+    Block<typename GraphType::node_id> *_changedNodes;
+
     //============================
     // Member functions:
 
@@ -89,6 +106,7 @@ private:
         // create a new image
         _pixelIdImage = ImageUtils<PixelIdImage>::createEmpty(
             img->GetLargestPossibleRegion().GetSize());
+        _pixelIdImage->CopyInformation(img);
 
         // fill it with identifiers
         itk::ImageRegionIteratorWithIndex<LabelIdImage> it(
@@ -199,9 +217,9 @@ private:
 
             PixelID pixelId = it.Get();
 
-            // skip pixels outside ROI
+            // pixels outside ROI
             if (pixelId == -1) {
-                it.Set(0);
+                _labelIdImage->SetPixel(it.GetIndex(), 0);
                 continue;
             }
 
@@ -226,6 +244,7 @@ private:
         DataCostFunction * dataCostFunction,
         SmoothnessCostFunction * smoothnessCostFunction
     ) {
+        delete _gc;
         assignIdsToPixels(labelImage);
 
         log("Building graph, %d nodes") % _totalPixelsInROI;
@@ -236,12 +255,7 @@ private:
         initializeDataCosts(dataCostFunction);
 
         initializeNeighbours(smoothnessCostFunction);
-        log("%d t-links added") % _totalNeighbors;
-
-//#if LOG_GRAPH_CUT_DETAILS == 1
-//        logger.log("Segm - Graph nodes", _totalPixelsInROI);
-//        logger.log("Segm - Graph neighbours", _totalNeighbors);
-//#endif
+        log("%d n-links added") % _totalNeighbors;
 
         _labelIdImage = labelImage;
     }
@@ -260,6 +274,7 @@ private:
 
         // Ende :)
         delete _gc;
+        _gc = NULL;
         return _labelIdImage;
     }
 
@@ -269,9 +284,14 @@ public:
 
     // Constructor
     GraphCutSegmentation()
-    : _gc(NULL)
+    : _gc(NULL), _solved(false), _changedNodes(NULL)
     { /* empty body */ };
 
+    ~GraphCutSegmentation() {
+        delete _gc;
+        delete _changedNodes;
+    }
+
 
 
     /*
@@ -299,6 +319,143 @@ public:
 
 
 
+    /*
+    Build the graph over the ROI (pixels as in optimize) with the smoothness
+    costs only, all data costs are 0. The graph is kept, so that it can be
+    solved repeatedly for different data costs set by updateDataCosts,
+    e.g. for several labels segmented within the same ROI.
+
+    Besides the graph, 16 bytes per node are allocated for the current data
+    costs and the pixel of each node.
+    */
+    void buildGraph(
+        LabelIdImagePointer roiImage,
+        SmoothnessCostFunction * smoothnessCostFunction
+    ) {
+        delete _gc;
+        _solved = false;
+
+        assignIdsToPixels(roiImage);
+
+        const PixelID *ids = _pixelIdImage->GetBufferPointer();
+        size_t totalPixels = _pixelIdImage->GetLargestPossibleRegion().GetNumberOfPixels();
+        _nodePixels.resize(_totalPixelsInROI);
+        for (size_t i = 0; i < totalPixels; ++i) {
+            if (ids[i] >= 0)
+                _nodePixels[ids[i]] = i;
+        }
+
+        log("Building graph, %d nodes") % _totalPixelsInROI;
+
+        _gc = new GraphType(_totalPixelsInROI, 3 * _totalPixelsInROI);
+        _gc->add_node(_totalPixelsInROI);
+        _dataCosts.assign(2 * (size_t)_totalPixelsInROI, 0);
+
+        initializeNeighbours(smoothnessCostFunction);
+        log("%d n-links added") % _totalNeighbors;
+    }
+
+
+
+    /*
+    Set the data costs of the given pixels (offsets in the image buffer) to
+    the costs computed by @dataCostFunction. Pixels outside ROI are skipped,
+    data costs of other pixels are kept. Only the t-links of pixels whose
+    costs changed are rewritten (by the difference to the current costs)
+    and marked, so that the next solve reuses the search trees.
+    */
+    void updateDataCosts(
+        DataCostFunction * dataCostFunction,
+        const std::vector<size_t> & pixels
+    ) {
+        assert(_gc != NULL);
+
+        const PixelID *ids = _pixelIdImage->GetBufferPointer();
+
+        unsigned changed = 0;
+        for (size_t k = 0; k < pixels.size(); ++k) {
+
+            PixelID pixelId = ids[pixels[k]];
+            if (pixelId < 0)
+                continue;
+
+            ImageIndex pixelIndex = _pixelIdImage->ComputeIndex(pixels[k]);
+            EnergyTerm dataCostSource = dataCostFunction->compute(pixelIndex, 0);
+            EnergyTerm dataCostSink = dataCostFunction->compute(pixelIndex, 1);
+
+            EnergyTerm & currentSource = _dataCosts[2 * pixelId];
+            EnergyTerm & currentSink = _dataCosts[2 * pixelId + 1];
+            if (dataCostSource == currentSource && dataCostSink == currentSink)
+                continue;
+
+            _gc->add_tweights(pixelId,
+                dataCostSource - currentSource, dataCostSink - currentSink);
+            currentSource = dataCostSource;
+            currentSink = dataCostSink;
+
+            if (_solved)
+                _gc->mark_node(pixelId);
+            changed++;
+        }
+
+        log("%d t-links changed") % changed;
+    }
+
+
+
+    /*
+    Compute the max flow of the graph built by buildGraph with the current
+    data costs and return the labelled image (labels as in optimize, 0
+    outside ROI). The graph is kept for further updates.
+
+    After the first solve, the search trees of the previous solve are
+    reused and only the labels of the nodes reported as changed by the
+    max flow are updated. The returned image is the same for all solves of
+    the graph, so it is overwritten by the next solve.
+    */
+    LabelIdImagePointer solve() {
+
+        assert(_gc != NULL);
+
+        if (!_solved) {
+            log("Computing the max flow");
+            _gc->maxflow();
+            log("Max flow computed");
+
+            _labelIdImage = ImageUtils<LabelIdImage>::createEmpty(
+                _pixelIdImage->GetLargestPossibleRegion().GetSize());
+            _labelIdImage->CopyInformation(_pixelIdImage);
+            updateLabelImageAccordingToGraph();
+
+            _solved = true;
+            if (_changedNodes == NULL)
+                _changedNodes = new Block<typename GraphType::node_id>(1024);
+            return _labelIdImage;
+        }
+
+        log("Computing the max flow, reusing search trees");
+        _gc->maxflow(true, _changedNodes);
+
+        LabelID *labels = _labelIdImage->GetBufferPointer();
+        unsigned changed = 0;
+        typename GraphType::node_id *node;
+        for (node = _changedNodes->ScanFirst(); node; node = _changedNodes->ScanNext()) {
+            _gc->remove_from_changed_list(*node);
+            LabelID newLabel = (_gc->what_segment(*node) == GraphType::SOURCE) ? 1 : 0;
+            LabelID & label = labels[_nodePixels[*node]];
+            if (label != newLabel) {
+                label = newLabel;
+                changed++;
+            }
+        }
+        _changedNodes->Reset();
+        log("Max flow computed, %d labels changed") % changed;
+
+        return _labelIdImage;
+    }
+
+
+
 };
 
 
@@ -0,0 +1,443 @@
+#pragma once
+
+#include "itkImage.h"
+
+#include <vector>
+#include <algorithm> //max,min
+#include <cmath>
+#include <cstddef>
+
+#include "ImageUtils.hpp"
+#include "ParallelUtils.hpp"
+#include "Globals.hpp"
+
+
+/*
+Geodesic active contour evolved only within a narrow band around the zero
+level set. The level set equation is the one of
+itk::GeodesicActiveContourLevelSetImageFilter (same signs and weights,
+derivatives scaled by the image spacing, time step computed as in
+itk::LevelSetFunction::ComputeGlobalTimeStep, same stopping criteria):
+
+    phi_t = curvatureScaling * g * kappa |grad phi|
+          - propagationScaling * g * |grad phi|     (upwind)
+          - advectionScaling * (-grad g) . grad phi  (upwind)
+
+where g is the feature image. The advection field is computed from the
+feature image by central differences.
+
+The band consists of layers of voxels as in the sparse-field method:
+layer 0 are the voxels with a 6-neighbour on the other side of the zero
+level set, layer k the neighbours of layer k-1 up to the band width. In
+each iteration the layers 0..bandWidth-1 are updated in parallel, then
+layer 0 is found again and the other layers are recomputed as the
+distance from it (the values of layer 0 are kept, so the front moves by
+less than a voxel, but their magnitude is limited by the distance to the
+neighbour on the other side). Voxels which leave the band are set to
++-(bandWidth+1) * the largest spacing. Besides one scan of the whole
+image at the beginning, all work is proportional to the band size.
+
+The RMS change of layer 0 is computed after the layers were rebuilt (so
+that a front held by an edge converges) and the evolution stops when it
+is below the maximum RMS error, or after the number of iterations.
+*/
+class NarrowBandGeodesicActiveContour {
+
+public:
+
+    NarrowBandGeodesicActiveContour() :
+        m_propagationScaling(1), m_curvatureScaling(1), m_advectionScaling(1),
+        m_maximumRMSError(0.02), m_numberOfIterations(1000), m_bandWidth(3),
+        m_elapsedIterations(0), m_rmsChange(0) {}
+
+    void SetInput(FloatImagePtr levelSet)           { m_input = levelSet; }
+    void SetFeatureImage(FloatImagePtr feature)     { m_feature = feature; }
+    void SetPropagationScaling(float scaling)       { m_propagationScaling = scaling; }
+    void SetCurvatureScaling(float scaling)         { m_curvatureScaling = scaling; }
+    void SetAdvectionScaling(float scaling)         { m_advectionScaling = scaling; }
+    void SetMaximumRMSError(float error)            { m_maximumRMSError = error; }
+    void SetNumberOfIterations(unsigned iterations) { m_numberOfIterations = iterations; }
+
+    // number of layers on each side of the zero level set (at least 2)
+    void SetBandWidth(unsigned layers)              { m_bandWidth = std::max(2u, layers); }
+
+    FloatImagePtr GetOutput()                       { return m_output; }
+    unsigned GetElapsedIterations()                 { return m_elapsedIterations; }
+    float GetRMSChange()                            { return m_rmsChange; }
+
+
+
+    void Update() {
+
+        ImageSize size = m_input->GetLargestPossibleRegion().GetSize();
+        FloatImage::SpacingType spacing = m_input->GetSpacing();
+        for (unsigned dim = 0; dim < 3; ++dim) {
+            m_size[dim] = size[dim];
+            m_spacing[dim] = spacing[dim];
+        }
+        m_stride[0] = 1;
+        m_stride[1] = m_size[0];
+        m_stride[2] = (ptrdiff_t)m_size[0] * m_size[1];
+
+        assert(m_feature->GetLargestPossibleRegion().GetSize() == size);
+
+        m_output = ImageUtils<FloatImage>::duplicate(m_input);
+        m_phi = m_output->GetBufferPointer();
+        m_g = m_feature->GetBufferPointer();
+
+        double maxSpacing = std::max(m_spacing[0], std::max(m_spacing[1], m_spacing[2]));
+        double minSpacing = std::min(m_spacing[0], std::min(m_spacing[1], m_spacing[2]));
+        m_far = (m_bandWidth + 1) * maxSpacing;
+
+        initializeLayers();
+
+        // time step constants of itk::LevelSetFunction (m_DT, m_WaveDT)
+        const double dt0 = 1.0 / (2.0 * Dimension);
+        const double maxScale = 1.0 / minSpacing;
+
+        std::vector<float> updates;
+        std::vector<float> previous;
+        std::vector<MaxChange> maxChange(ParallelUtils::numberOfThreads());
+
+        m_elapsedIterations = 0;
+        m_rmsChange = 0;
+
+        while (m_layers[0].size() > 0) {
+
+            if (m_numberOfIterations != 0 && m_elapsedIterations >= m_numberOfIterations)
+                break;
+            if (m_elapsedIterations != 0 && m_rmsChange < m_maximumRMSError)
+                break;
+
+            // voxels to update: layers 0..bandWidth-1, layer 0 first
+            m_updated.clear();
+            for (unsigned k = 0; k < m_bandWidth; ++k)
+                m_updated.insert(m_updated.end(), m_layers[k].begin(), m_layers[k].end());
+            updates.resize(m_updated.size());
+            std::fill(maxChange.begin(), maxChange.end(), MaxChange());
+
+            ParallelUtils::parallelFor(0, m_updated.size(),
+                [&](size_t from, size_t to, unsigned threadId) {
+                    MaxChange threadMax;
+                    for (size_t k = from; k < to; ++k)
+                        updates[k] = computeUpdate(m_updated[k], threadMax);
+                    maxChange[threadId] = threadMax;
+                });
+
+            MaxChange change;
+            for (unsigned t = 0; t < maxChange.size(); ++t)
+                change.merge(maxChange[t]);
+            double dt = computeTimeStep(change, dt0, maxScale);
+
+            size_t activeSize = m_layers[0].size();
+            previous.resize(activeSize);
+            for (size_t k = 0; k < activeSize; ++k)
+                previous[k] = m_phi[m_updated[k]];
+
+            for (size_t k = 0; k < m_updated.size(); ++k)
+                m_phi[m_updated[k]] += dt * updates[k];
+
+            rebuildLayers();
+
+            // RMS change over the previous layer 0, after the layers were rebuilt
+            double rms = 0;
+            for (size_t k = 0; k < activeSize; ++k) {
+                double delta = m_phi[m_updated[k]] - previous[k];
+                rms += delta * delta;
+            }
+            m_rmsChange = std::sqrt(rms / activeSize);
+            m_elapsedIterations++;
+        }
+
+        log("Narrow band level set: %d iterations, RMS change %f, %d voxels in the band")
+            % m_elapsedIterations % m_rmsChange % m_updated.size();
+    }
+
+
+private:
+
+    enum { OUTSIDE = 255 };
+
+    // largest speeds of the terms within an iteration, for the time step
+    struct MaxChange {
+        float advection;
+        float propagation;
+        float curvature;
+
+        MaxChange() : advection(0), propagation(0), curvature(0) {}
+
+        void merge(const MaxChange & other) {
+            advection = std::max(advection, other.advection);
+            propagation = std::max(propagation, other.propagation);
+            curvature = std::max(curvature, other.curvature);
+        }
+    };
+
+    FloatImagePtr m_input;
+    FloatImagePtr m_feature;
+    FloatImagePtr m_output;
+
+    float m_propagationScaling;
+    float m_curvatureScaling;
+    float m_advectionScaling;
+    float m_maximumRMSError;
+    unsigned m_numberOfIterations;
+    unsigned m_bandWidth;
+
+    unsigned m_elapsedIterations;
+    float m_rmsChange;
+
+    int m_size[3];
+    ptrdiff_t m_stride[3];
+    double m_spacing[3];
+    float *m_phi;
+    const float *m_g;
+    float m_far;
+
+    // layer of each voxel, OUTSIDE for voxels outside the band
+    std::vector<unsigned char> m_layer;
+
+    // voxels of each layer 0..bandWidth
+    std::vector<std::vector<size_t> > m_layers;
+
+    // voxels updated in the last iteration
+    std::vector<size_t> m_updated;
+
+
+
+    void getCoordinates(size_t idx, int coords[3]) const {
+        coords[0] = idx % m_size[0];
+        coords[1] = (idx / m_size[0]) % m_size[1];
+        coords[2] = idx / m_stride[2];
+    }
+
+
+
+    /*
+    Distance to the nearest 6-neighbour on the other side of the zero
+    level set, 0 if there is none (the voxel is not in layer 0). The zero
+    level set is closer than that, so it also bounds |phi| in layer 0.
+    */
+    float distanceToOtherSide(size_t idx) const {
+        int coords[3];
+        getCoordinates(idx, coords);
+        bool positive = (m_phi[idx] >= 0);
+        float distance = 0;
+        for (unsigned dim = 0; dim < 3; ++dim) {
+            bool found =
+                (coords[dim] > 0 && (m_phi[idx - m_stride[dim]] >= 0) != positive) ||
+                (coords[dim] < m_size[dim] - 1 && (m_phi[idx + m_stride[dim]] >= 0) != positive);
+            if (found && (distance == 0 || m_spacing[dim] < distance))
+                distance = m_spacing[dim];
+        }
+        return distance;
+    }
+
+
+
+    // layers 1..bandWidth as the distance from layer 0
+    void computeOuterLayers() {
+        for (unsigned k = 1; k <= m_bandWidth; ++k) {
+            m_layers[k].clear();
+            const std::vector<size_t> & previous = m_layers[k-1];
+            for (size_t n = 0; n < previous.size(); ++n) {
+                size_t p = previous[n];
+                int coords[3];
+                getCoordinates(p, coords);
+
+                for (unsigned dim = 0; dim < 3; ++dim)
+                    for (int step = -1; step <= 1; step += 2) {
+                        if (coords[dim] + step < 0 || coords[dim] + step >= m_size[dim])
+                            continue;
+                        size_t q = p + step * m_stride[dim];
+                        if (m_layer[q] < k)
+                            continue;
+
+                        float value = std::fabs(m_phi[p]) + m_spacing[dim];
+                        if (m_layer[q] == k) {
+                            if (value < std::fabs(m_phi[q]))
+                                m_phi[q] = (m_phi[q] >= 0) ? value : -value;
+                        } else {
+                            m_layer[q] = k;
+                            m_layers[k].push_back(q);
+                            m_phi[q] = (m_phi[q] >= 0) ? value : -value;
+                        }
+                    }
+            }
+        }
+    }
+
+
+
+    // build the layers from the zero level set of the input
+    void initializeLayers() {
+        size_t total = (size_t)m_stride[2] * m_size[2];
+
+        m_layer.assign(total, OUTSIDE);
+        m_layers.assign(m_bandWidth + 1, std::vector<size_t>());
+
+        for (size_t i = 0; i < total; ++i) {
+            if (distanceToOtherSide(i) > 0) {
+                m_layer[i] = 0;
+                m_layers[0].push_back(i);
+            }
+        }
+
+        computeOuterLayers();
+
+        ParallelUtils::parallelFor(0, total,
+            [&](size_t from, size_t to, unsigned) {
+                for (size_t i = from; i < to; ++i)
+                    if (m_layer[i] == OUTSIDE)
+                        m_phi[i] = (m_phi[i] >= 0) ? m_far : -m_far;
+            });
+    }
+
+
+
+    // find layer 0 after an update of the band and recompute other layers
+    void rebuildLayers() {
+        std::vector<size_t> band;
+        for (unsigned k = 0; k <= m_bandWidth; ++k)
+            band.insert(band.end(), m_layers[k].begin(), m_layers[k].end());
+
+        // layer 0, values clamped so that the front stays between the voxels
+        std::vector<float> bounds;
+        m_layers[0].clear();
+        for (size_t n = 0; n < band.size(); ++n) {
+            float bound = distanceToOtherSide(band[n]);
+            if (bound > 0) {
+                m_layers[0].push_back(band[n]);
+                bounds.push_back(bound);
+            }
+        }
+        for (size_t n = 0; n < m_layers[0].size(); ++n) {
+            float & value = m_phi[m_layers[0][n]];
+            value = std::max(-bounds[n], std::min(bounds[n], value));
+        }
+
+        for (size_t n = 0; n < band.size(); ++n)
+            m_layer[band[n]] = OUTSIDE;
+        for (size_t n = 0; n < m_layers[0].size(); ++n)
+            m_layer[m_layers[0][n]] = 0;
+
+        computeOuterLayers();
+
+        // voxels which left the band
+        for (size_t n = 0; n < band.size(); ++n) {
+            size_t i = band[n];
+            if (m_layer[i] == OUTSIDE)
+                m_phi[i] = (m_phi[i] >= 0) ? m_far : -m_far;
+        }
+    }
+
+
+
+    /*
+    Time step of itk::LevelSetFunction::ComputeGlobalTimeStep: limited by
+    the CFL condition of the advection and propagation speeds and by the
+    largest curvature term, and divided by the largest scale coefficient
+    (1 / smallest spacing). It is 0 if all terms vanish.
+    */
+    static double computeTimeStep(const MaxChange & change, double dt0, double maxScale) {
+        double waveChange = change.advection + change.propagation;
+        double dt = 0;
+        if (change.curvature > 0) {
+            dt = dt0 / change.curvature;
+            if (waveChange > 0)
+                dt = std::min(dt, dt0 / waveChange);
+        } else if (waveChange > 0) {
+            dt = dt0 / waveChange;
+        }
+        return dt / maxScale;
+    }
+
+
+
+    /*
+    Right-hand side of the level set equation at voxel idx (see
+    itk::LevelSetFunction::ComputeUpdate). maxChange is updated with the
+    magnitudes of the terms used for the time step.
+    */
+    float computeUpdate(size_t idx, MaxChange & maxChange) const {
+        int coords[3];
+        getCoordinates(idx, coords);
+
+        // offsets of the neighbours, clamped at the border of the image
+        ptrdiff_t prev[3], next[3];
+        for (unsigned dim = 0; dim < 3; ++dim) {
+            prev[dim] = (coords[dim] > 0) ? -m_stride[dim] : 0;
+            next[dim] = (coords[dim] < m_size[dim] - 1) ? m_stride[dim] : 0;
+        }
+
+        const float *phi = m_phi + idx;
+        const float center = phi[0];
+
+        float dx[3], dxForward[3], dxBackward[3], dxx[3][3];
+        float gradMagSqr = 1e-6;
+        for (unsigned i = 0; i < 3; ++i) {
+            const float scale = 1.0 / m_spacing[i];
+            dx[i] = 0.5 * (phi[next[i]] - phi[prev[i]]) * scale;
+            dxForward[i] = (phi[next[i]] - center) * scale;
+            dxBackward[i] = (center - phi[prev[i]]) * scale;
+            dxx[i][i] = (phi[next[i]] + phi[prev[i]] - 2.0 * center) * scale * scale;
+            gradMagSqr += dx[i] * dx[i];
+        }
+        for (unsigned i = 0; i < 3; ++i)
+            for (unsigned j = i + 1; j < 3; ++j) {
+                dxx[i][j] = dxx[j][i] = 0.25 *
+                    ( phi[next[i] + next[j]] - phi[next[i] + prev[j]]
+                    - phi[prev[i] + next[j]] + phi[prev[i] + prev[j]] )
+                    / (m_spacing[i] * m_spacing[j]);
+            }
+
+        const float g = m_g[idx];
+
+        // mean curvature times the gradient magnitude
+        float curvatureTerm = 0;
+        if (m_curvatureScaling != 0) {
+            for (unsigned i = 0; i < 3; ++i)
+                for (unsigned j = 0; j < 3; ++j) {
+                    if (j == i)
+                        continue;
+                    curvatureTerm -= dx[i] * dx[j] * dxx[i][j];
+                    curvatureTerm += dxx[j][j] * dx[i] * dx[i];
+                }
+            curvatureTerm = curvatureTerm / gradMagSqr * m_curvatureScaling * g;
+            maxChange.curvature = std::max(maxChange.curvature, std::fabs(curvatureTerm));
+        }
+
+        // advection along the negative gradient of the feature image
+        float advectionTerm = 0;
+        if (m_advectionScaling != 0) {
+            const float *feature = m_g + idx;
+            for (unsigned i = 0; i < 3; ++i) {
+                float field = -0.5 * (feature[next[i]] - feature[prev[i]]) / m_spacing[i];
+                float energy = m_advectionScaling * field;
+                advectionTerm += energy * ((energy > 0) ? dxBackward[i] : dxForward[i]);
+                maxChange.advection = std::max(maxChange.advection, std::fabs(energy));
+            }
+        }
+
+        // propagation with upwind gradient
+        float propagationTerm = 0;
+        if (m_propagationScaling != 0) {
+            float speed = m_propagationScaling * g;
+            float gradient = 0;
+            for (unsigned i = 0; i < 3; ++i) {
+                if (speed > 0) {
+                    gradient += std::max(dxBackward[i], 0.0f) * std::max(dxBackward[i], 0.0f)
+                              + std::min(dxForward[i], 0.0f) * std::min(dxForward[i], 0.0f);
+                } else {
+                    gradient += std::min(dxBackward[i], 0.0f) * std::min(dxBackward[i], 0.0f)
+                              + std::max(dxForward[i], 0.0f) * std::max(dxForward[i], 0.0f);
+                }
+            }
+            propagationTerm = speed * std::sqrt(gradient);
+            maxChange.propagation = std::max(maxChange.propagation, std::fabs(speed));
+        }
+
+        return curvatureTerm - propagationTerm - advectionTerm;
+    }
+
+};
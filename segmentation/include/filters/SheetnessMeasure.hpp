@@ -18,11 +18,12 @@
 
 #include "itkImageRegionIterator.h"
 #include "itkImportImageFilter.h"
+#include "itkRegionOfInterestImageFilter.h"
 #include "vnl/vnl_math.h"
 #include <itkSmoothingRecursiveGaussianImageFilter.h>
-#include "vnl/algo/vnl_symmetric_eigensystem.h"
 
 #include <limits>
+#include <vector>
 #include "Globals.hpp"
 
 
@@ -57,6 +58,7 @@ public:
 	void SetGamma(double c);
 	void SetSigma(double s);
 	void SetBrightObject(bool cond);
+	void SetHessianScaling(VectorType scaling);
 
 	void ScaleObjectnessMeasureOff();
 	void ScaleObjectnessMeasureOn();
@@ -73,6 +75,7 @@ private:
 	double alpha, beta, gamma, sigma;
 	float bright;
 	bool scaleObjectnessMeasure;
+	VectorType hessian_scaling;
 
 	void Eigenvalues_3_3_symetric(
         float M11, float M12, float M13, float M22, float M23, float M33,
@@ -83,7 +86,10 @@ private:
         VectorType & eigenVals,
         VectorType & firstPrincipalEigenvector);
 
-	void GenerateObjectnessImage();
+	ImageType::RegionType GetPaddedROIBoundingBox();
+
+	void GenerateObjectnessImage(
+        ImagePointerType smoothed_image, ImageType::IndexType offset);
 };
 
 
@@ -99,6 +105,7 @@ MemoryEfficientObjectnessFilter::MemoryEfficientObjectnessFilter()
 	objectDimension = 2;
 	scaleObjectnessMeasure = false;
 	bright = 1;
+	hessian_scaling.Fill(1);
 }
 
 //
@@ -118,47 +125,160 @@ void MemoryEfficientObjectnessFilter::SetBrightObject(bool cond)
 	if (cond)	bright = 1;
 	else		bright = -1;
 }
+// Scale of the finite-difference derivatives along each axis, e.g. 1/2 along
+// axes of an image downsampled by 2 gives hessians in the units of the
+// original grid.
+void MemoryEfficientObjectnessFilter::SetHessianScaling(VectorType scaling) { hessian_scaling = scaling; }
 void MemoryEfficientObjectnessFilter::ScaleObjectnessMeasureOff() { scaleObjectnessMeasure = false; }
 void MemoryEfficientObjectnessFilter::ScaleObjectnessMeasureOn()  { scaleObjectnessMeasure = true; }
 
 //
 //
 //
+// If a ROI is set, only its bounding box (padded by the support of the
+// gaussian and the hessian stencil) is smoothed and only voxels within
+// the ROI are evaluated. Voxels outside the ROI are set to 0.
 void MemoryEfficientObjectnessFilter::Update()
 {
 	typedef itk::SmoothingRecursiveGaussianImageFilter <ImageType> FilterType;
+	typedef itk::RegionOfInterestImageFilter <ImageType,ImageType> ROIFilterType;
 	FilterType::Pointer filter = FilterType::New();
 
-	filter->SetInput( input_image );
+	ImageType::RegionType largestRegion = input_image->GetLargestPossibleRegion();
+	ImageType::RegionType region = largestRegion;
+	if (roi_image.IsNotNull())
+		region = GetPaddedROIBoundingBox();
+
+	bool cropped = (region != largestRegion);
+
+	if (cropped) {
+		// full-size output, zero outside the ROI
+		output_image = ImageType::New();
+		output_image->CopyInformation(input_image);
+		output_image->SetRegions(largestRegion);
+		output_image->Allocate();
+		output_image->FillBuffer(0);
+
+		if (region.GetNumberOfPixels() == 0) {
+			log("Empty ROI, nothing to compute");
+			return;
+		}
+
+		ROIFilterType::Pointer roiFilter = ROIFilterType::New();
+		roiFilter->SetInput( input_image );
+		roiFilter->SetRegionOfInterest( region );
+		filter->SetInput( roiFilter->GetOutput() );
+	} else {
+		filter->SetInput( input_image );
+	}
+
 	filter->SetSigma( sigma );
 	filter->Update();
-	output_image = filter->GetOutput();
+	ImagePointerType smoothed_image = filter->GetOutput();
+
+	smoothed_image->DisconnectPipeline();
+
+	// without cropping, the objectness is written back into the smoothed image
+	if (!cropped)
+		output_image = smoothed_image;
+
+	GenerateObjectnessImage(smoothed_image, region.GetIndex());
+}
+
+
+
+// Bounding box of the ROI voxels, padded by 4 sigma (the effective support
+// of the recursive gaussian) plus the 2 voxels of the hessian stencil and
+// clipped to the image. Empty region if the ROI is empty.
+MemoryEfficientObjectnessFilter::ImageType::RegionType
+MemoryEfficientObjectnessFilter::GetPaddedROIBoundingBox()
+{
+	ImageType::RegionType largestRegion = input_image->GetLargestPossibleRegion();
+	ImageType::SizeType size = largestRegion.GetSize();
+	ImageType::SpacingType spacing = input_image->GetSpacing();
+
+	assert(roi_image->GetLargestPossibleRegion().GetSize() == size);
+
+	int w = size[0], h = size[1], d = size[2];
+	int lower[3] = { w, h, d };
+	int upper[3] = { -1, -1, -1 };
+
+	const ROIImageType::PixelType *roi = roi_image->GetBufferPointer();
+	for (int k=0 ; k<d ; k++)
+		for (int j=0 ; j<h; j++)
+		{
+			const ROIImageType::PixelType *row = roi + j*w + k*w*h;
+			for (int i=0 ; i<w ; i++)
+			{
+				if (row[i] == 0)
+					continue;
+				lower[0] = std::min(lower[0], i); upper[0] = std::max(upper[0], i);
+				lower[1] = std::min(lower[1], j); upper[1] = std::max(upper[1], j);
+				lower[2] = std::min(lower[2], k); upper[2] = std::max(upper[2], k);
+			}
+		}
+
+	ImageType::RegionType region;
+	ImageType::IndexType start;
+	ImageType::SizeType regionSize;
+	start.Fill(0);
+	regionSize.Fill(0);
+
+	if (upper[0] < 0) {
+		region.SetIndex(start);
+		region.SetSize(regionSize);
+		return region;
+	}
 
-	output_image->DisconnectPipeline();
+	for (unsigned dim=0; dim<3; ++dim) {
+		int pad = (int)ceil(4.0 * sigma / spacing[dim]) + 2;
+		int from = std::max(0, lower[dim] - pad);
+		int to = std::min((int)size[dim] - 1, upper[dim] + pad);
+		start[dim] = from;
+		regionSize[dim] = to - from + 1;
+	}
 
-	GenerateObjectnessImage();
+	region.SetIndex(start);
+	region.SetSize(regionSize);
+	return region;
 }
 
 MemoryEfficientObjectnessFilter::ImagePointerType MemoryEfficientObjectnessFilter::GetOutput()	{ return output_image; }
 
-void MemoryEfficientObjectnessFilter::GenerateObjectnessImage()
+void MemoryEfficientObjectnessFilter::GenerateObjectnessImage(
+    ImagePointerType smoothed_image, ImageType::IndexType offset)
 {
-	// define variables for image size
+	// define variables for image size (of the smoothed, possibly cropped, image)
 	int w,h,d,wh,whd;
-	w = output_image->GetLargestPossibleRegion().GetSize()[0];
-	h = output_image->GetLargestPossibleRegion().GetSize()[1];
-	d = output_image->GetLargestPossibleRegion().GetSize()[2];
+	w = smoothed_image->GetLargestPossibleRegion().GetSize()[0];
+	h = smoothed_image->GetLargestPossibleRegion().GetSize()[1];
+	d = smoothed_image->GetLargestPossibleRegion().GetSize()[2];
 	wh = w*h;
 	whd = wh*d;
 
+	// size of the output image, offset is the position of the smoothed image in it
+	int W,H,WH;
+	W = output_image->GetLargestPossibleRegion().GetSize()[0];
+	H = output_image->GetLargestPossibleRegion().GetSize()[1];
+	WH = W*H;
+	int outputOffset = offset[0] + offset[1]*W + offset[2]*WH;
+
 	//variables for browsing through image
-	ImageType::IndexType image_index;	image_index[0]=0;image_index[1]=0;image_index[2]=0;
 	int add;
 	int pi, mi, pj, mj, pk, mk, p2i, m2i, p2j, m2j, p2k, m2k;
 
 	//
 	PixelType *img; //img = (PixelType *) calloc( wh*d, sizeof(PixelType) );
-	img = output_image->GetBufferPointer();
+	img = smoothed_image->GetBufferPointer();
+	PixelType *out = output_image->GetBufferPointer();
+	const ROIImageType::PixelType *roi =
+		roi_image.IsNotNull() ? roi_image->GetBufferPointer() : NULL;
+	VectorType *vec = NULL;
+	if (vector_image.IsNotNull()) {
+		assert(vector_image->GetLargestPossibleRegion().GetSize()
+			== output_image->GetLargestPossibleRegion().GetSize());
+		vec = vector_image->GetBufferPointer();
+	}
 	float hxx, hyy, hzz, hxy, hxz, hyz;
 	float tmp;
 	//float *l; l = (float *)calloc(3,sizeof(float));
@@ -168,12 +288,21 @@ void MemoryEfficientObjectnessFilter::GenerateObjectnessImage()
 	float al1, al2, al3, sum; double mean_norm=0;
 	float Rsheet, Rblob, Rtube, Rnoise;
 	float alpha_sq = 2*alpha*alpha, beta_sq = 2*beta*beta, gamma_sq = 2*gamma*gamma;
+	float sxx = hessian_scaling[0]*hessian_scaling[0];
+	float syy = hessian_scaling[1]*hessian_scaling[1];
+	float szz = hessian_scaling[2]*hessian_scaling[2];
+	float sxy = hessian_scaling[0]*hessian_scaling[1];
+	float sxz = hessian_scaling[0]*hessian_scaling[2];
+	float syz = hessian_scaling[1]*hessian_scaling[2];
 
     unsigned pixelsInRoi = 0;
 
+    // runs [begin,end) of ROI voxels within the current row,
+    // without a ROI the whole row is one run
+    std::vector< std::pair<int,int> > runs;
+
 	for (int k=0 ; k<d ; k++)
 	{
-	    image_index[2] = k;
 		pk=wh; p2k=2*wh; mk=-wh; m2k=-2*wh;
 		if ( (k<2) || (k>d-3) )
 		{
@@ -185,7 +314,6 @@ void MemoryEfficientObjectnessFilter::GenerateObjectnessImage()
 
 		for (int j=0 ; j<h; j++)
 		{
-            image_index[1] = j;
 			pj=w; p2j=2*w; mj=-w; m2j=-2*w;
 			if ( (j<2) || (j>h-3) )
 			{
@@ -194,16 +322,28 @@ void MemoryEfficientObjectnessFilter::GenerateObjectnessImage()
 				if (j==1)	m2j=-w;
 				if (j==h-2) p2j= w;
 			}
-			for (int i=0 ; i<w ; i++)
-			{
-                image_index[0] = i;
-				add = i + j*w + k*wh; //current pixel
 
-                // dont process pixels outside roi
-                if (roi_image.IsNotNull() && roi_image->GetPixel(image_index) == 0) {
-                    tmp_obj[add] = 0;
-                    continue;
+            // dont process pixels outside roi
+            runs.clear();
+            if (roi == NULL) {
+                runs.push_back(std::make_pair(0, w));
+            } else {
+                const ROIImageType::PixelType *roiRow =
+                    roi + outputOffset + j*W + k*WH;
+                for (int i=0 ; i<w ; i++) {
+                    if (roiRow[i] == 0)
+                        continue;
+                    int begin = i;
+                    while (i<w && roiRow[i] != 0)
+                        i++;
+                    runs.push_back(std::make_pair(begin, i));
                 }
+            }
+
+            for (unsigned r=0 ; r<runs.size() ; r++)
+			for (int i=runs[r].first ; i<runs[r].second ; i++)
+			{
+				add = i + j*w + k*wh; //current pixel
 
                 pixelsInRoi++;
 
@@ -225,15 +365,16 @@ void MemoryEfficientObjectnessFilter::GenerateObjectnessImage()
 				hxz = (img[add+mi+mk] - img[add+pi+mk] - img[add+mi+pk] + img[add+pi+pk])/4.0;
 				hyz = (img[add+mj+mk] - img[add+pj+mk] - img[add+mj+pk] + img[add+pj+pk])/4.0;
 
+				hxx *= sxx; hyy *= syy; hzz *= szz;
+				hxy *= sxy; hxz *= sxz; hyz *= syz;
+
 
                 VectorType eigenVals;
 
-                if (vector_image.IsNotNull()) {
-                    VectorType principalEigenVector;
+                if (vec != NULL) {
                     solve_3x3_symmetric_eigensystem(
                         hxx, hxy, hxz, hyy, hyz, hzz,
-                        eigenVals, principalEigenVector);
-                    vector_image->SetPixel(image_index, principalEigenVector);
+                        eigenVals, vec[outputOffset + i + j*W + k*WH]);
                 } else {
                     Eigenvalues_3_3_symetric(hxx, hxy, hxz, hyy, hyz, hzz, eigenVals);
                 }
@@ -272,19 +413,18 @@ void MemoryEfficientObjectnessFilter::GenerateObjectnessImage()
 
     log("Mean norm = %1%") % mean_norm;
 
+	// voxels outside the ROI have tmp_obj = tmp_sum = 0 and stay 0
 	for (int k=0 ; k<d ; k++)
 	{
-		image_index[2] = k;
 		for (int j=0 ; j<h; j++)
 		{
-			image_index[1] = j;
+			PixelType *outRow = out + outputOffset + j*W + k*WH;
 			for (int i=0 ; i<w ; i++)
 			{
-				image_index[0] = i;
 				add = i + j*w + k*wh;
 				Rnoise = tmp_sum[add]/mean_norm;
 				tmp_obj[add] *= (1 - exp(-Rnoise*Rnoise/0.25));
-				output_image->SetPixel(image_index, tmp_obj[add]);
+				outRow[i] = tmp_obj[add];
 			}
 		}
 	}
@@ -293,42 +433,97 @@ void MemoryEfficientObjectnessFilter::GenerateObjectnessImage()
 
 
 //sorted by increasing absolute value
+//Closed-form solution: eigenvalues by the trigonometric solution of the
+//characteristic cubic, the principal eigenvector as the largest cross product
+//of two rows of (M - lambda3 I). If lambda3 is a double eigenvalue, any unit
+//vector orthogonal to the non-zero row is returned; if M is isotropic
+//(no principal direction), the zero vector is returned.
 void MemoryEfficientObjectnessFilter::solve_3x3_symmetric_eigensystem(
     float M11, float M12, float M13, float M22, float M23, float M33,
     VectorType & eigenVals, VectorType & firstPrincipalEigenvector
 ) {
 
-    // prepare
-    float vals[9] = {
-        M11, M12, M13,
-        M12, M22, M23,
-        M13, M23, M33
-    };
-    vnl_matrix<float> m(3,3,3*3, vals);
-
-    // solve the eigensystem
-    vnl_symmetric_eigensystem<float> eigenSolver(m);
-
-    // store eigenvalues
-    for (unsigned i=0; i<3; ++i) {
-        eigenVals[i] = eigenSolver.get_eigenvalue(i);
+    // eigenvalues, p^2 is the variance of the eigenvalues around q
+    double q = (M11 + M22 + M33) / 3.0;
+    double a11 = M11 - q, a22 = M22 - q, a33 = M33 - q;
+    double p1 = M12*M12 + M13*M13 + M23*M23;
+    double p = sqrt((a11*a11 + a22*a22 + a33*a33 + 2.0*p1) / 6.0);
+
+    double l[3] = { q, q, q };
+    if (p > 0) {
+        double det = a11*(a22*a33 - M23*M23) - M12*(M12*a33 - M23*M13) + M13*(M12*M23 - a22*M13);
+        double r = det / (2.0*p*p*p);
+        r = std::max(-1.0, std::min(1.0, r));
+        double phi = acos(r) / 3.0;
+        l[0] = q + 2.0*p*cos(phi);
+        l[2] = q + 2.0*p*cos(phi + 2.0943951023931955); // + 2pi/3
+        l[1] = 3.0*q - l[0] - l[2];
     }
 
     // sort eigenvalues by increasing absolute values
-	if (abs(eigenVals[0])>abs(eigenVals[1])) {swap(eigenVals[0],eigenVals[1]); }
-	if (abs(eigenVals[1])>abs(eigenVals[2])) {swap(eigenVals[1],eigenVals[2]); }
-	if (abs(eigenVals[0])>abs(eigenVals[1])) {swap(eigenVals[0],eigenVals[1]); }
+    double tmp;
+    if (fabs(l[0])>fabs(l[1])) {tmp=l[0];l[0]=l[1];l[1]=tmp;}
+    if (fabs(l[1])>fabs(l[2])) {tmp=l[1];l[1]=l[2];l[2]=tmp;}
+    if (fabs(l[0])>fabs(l[1])) {tmp=l[0];l[0]=l[1];l[1]=tmp;}
+
+    for (unsigned i=0; i<3; ++i)
+        eigenVals[i] = (float)l[i];
+
+    // rows of (M - lambda3 I), the eigenvector is orthogonal to all of them
+    double lambda = l[2];
+    double r0[3] = { M11 - lambda, M12, M13 };
+    double r1[3] = { M12, M22 - lambda, M23 };
+    double r2[3] = { M13, M23, M33 - lambda };
+
+    double c01[3] = { r0[1]*r1[2] - r0[2]*r1[1], r0[2]*r1[0] - r0[0]*r1[2], r0[0]*r1[1] - r0[1]*r1[0] };
+    double c02[3] = { r0[1]*r2[2] - r0[2]*r2[1], r0[2]*r2[0] - r0[0]*r2[2], r0[0]*r2[1] - r0[1]*r2[0] };
+    double c12[3] = { r1[1]*r2[2] - r1[2]*r2[1], r1[2]*r2[0] - r1[0]*r2[2], r1[0]*r2[1] - r1[1]*r2[0] };
+    double n01 = c01[0]*c01[0] + c01[1]*c01[1] + c01[2]*c01[2];
+    double n02 = c02[0]*c02[0] + c02[1]*c02[1] + c02[2]*c02[2];
+    double n12 = c12[0]*c12[0] + c12[1]*c12[1] + c12[2]*c12[2];
+
+    double *c = c01, n = n01;
+    if (n02 > n) { c = c02; n = n02; }
+    if (n12 > n) { c = c12; n = n12; }
+
+    // degeneracy is judged relative to the spread of the eigenvalues
+    double scale = 6.0*p*p;
+    const double eps = 1e-6;
+
+    if (n > eps*scale*scale) {
+        double inv = 1.0 / sqrt(n);
+        for (unsigned idx=0; idx < 3; ++idx)
+            firstPrincipalEigenvector[idx] = c[idx]*inv;
+        return;
+    }
 
-    // find the first principal eigenvector
-    for (unsigned i=0; i<3; ++i) {
-        if (abs(eigenSolver.get_eigenvalue(i)) == abs(eigenVals[2])) {
+    // rank(M - lambda3 I) <= 1, take the largest row
+    double m0 = r0[0]*r0[0] + r0[1]*r0[1] + r0[2]*r0[2];
+    double m1 = r1[0]*r1[0] + r1[1]*r1[1] + r1[2]*r1[2];
+    double m2 = r2[0]*r2[0] + r2[1]*r2[1] + r2[2]*r2[2];
 
-            for (unsigned idx=0; idx < 3; ++idx)
-                firstPrincipalEigenvector[idx] = eigenSolver.get_eigenvector(i)[idx];
+    double *row = r0, m = m0;
+    if (m1 > m) { row = r1; m = m1; }
+    if (m2 > m) { row = r2; m = m2; }
 
-            break;
-        }
+    if (m <= eps*scale) {
+        firstPrincipalEigenvector.Fill(0);
+        return;
     }
+
+    // cross product of the row with the axis it is least aligned with
+    double o[3];
+    if (fabs(row[0]) <= fabs(row[1]) && fabs(row[0]) <= fabs(row[2])) {
+        o[0] = 0; o[1] = row[2]; o[2] = -row[1];
+    } else if (fabs(row[1]) <= fabs(row[2])) {
+        o[0] = -row[2]; o[1] = 0; o[2] = row[0];
+    } else {
+        o[0] = row[1]; o[1] = -row[0]; o[2] = 0;
+    }
+
+    double inv = 1.0 / sqrt(o[0]*o[0] + o[1]*o[1] + o[2]*o[2]);
+    for (unsigned idx=0; idx < 3; ++idx)
+        firstPrincipalEigenvector[idx] = o[idx]*inv;
 }
 
 
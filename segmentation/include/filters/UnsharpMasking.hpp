@@ -0,0 +1,247 @@
+#pragma once
+
+#include "itkImage.h"
+#include "itkGaussianOperator.h"
+
+#include <vector>
+#include <algorithm> //max,min
+#include <cmath>
+
+#include "ParallelUtils.hpp"
+#include "Globals.hpp"
+
+
+/*
+Unsharp masking of a CT image:
+
+    output = ct + amount * (ct - G * ct)
+
+where G is the discrete gaussian kernel used by itk::DiscreteGaussianImageFilter
+(same variance in physical units, maximum error and kernel width, and the same
+zero-flux boundary condition), so the output matches the original
+add/substract/linearTransform/gaussian chain up to float rounding.
+
+The short CT is read directly and the result is written into a single float
+volume, which is also used as the buffer for the separable gaussian passes
+(z, then y, then x). Slices are processed in parallel.
+
+If a ROI is set, the output is only computed within the bounding box of the
+ROI padded by ceil(margin/spacing)+2 voxels and is 0 elsewhere. With margin
+equal to 4 * the largest sigma of the sheetness measure, this is exactly the
+part of the image read by MemoryEfficientObjectnessFilter with the same ROI,
+so the output can be passed to it directly.
+*/
+class UnsharpMaskingFilter {
+
+public:
+
+    UnsharpMaskingFilter() :
+        m_variance(1.0), m_amount(10.0), m_roiMargin(0) {}
+
+    void SetImage(ShortImagePtr image)      { m_image = image; }
+    void SetVariance(double variance)       { m_variance = variance; }
+    void SetAmount(float amount)            { m_amount = amount; }
+    void SetROIImage(UCharImagePtr roi)     { m_roi = roi; }
+    void SetROIMargin(double margin)        { m_roiMargin = margin; }
+
+    FloatImagePtr GetOutput()               { return m_output; }
+
+    void Update() {
+
+        ImageSize size = m_image->GetLargestPossibleRegion().GetSize();
+        const int w = size[0], h = size[1], d = size[2];
+
+        m_output = FloatImage::New();
+        m_output->CopyInformation(m_image);
+        m_output->SetRegions(m_image->GetLargestPossibleRegion());
+        m_output->Allocate();
+        m_output->FillBuffer(0);
+
+        int lower[3] = { 0, 0, 0 };
+        int upper[3] = { w-1, h-1, d-1 };
+        if (m_roi.IsNotNull() && !getPaddedROIBoundingBox(lower, upper)) {
+            log("Empty ROI, nothing to compute");
+            return;
+        }
+
+        // kernels along x, y, z
+        std::vector<float> kernel[3];
+        int radius[3];
+        for (unsigned dim = 0; dim < 3; ++dim) {
+            kernel[dim] = gaussianKernel(dim);
+            radius[dim] = kernel[dim].size() / 2;
+        }
+
+        // region of the intermediate results needed by the later passes
+        int lowerY = std::max(0, lower[1] - radius[1]);
+        int upperY = std::min(h-1, upper[1] + radius[1]);
+        int lowerX = std::max(0, lower[0] - radius[0]);
+        int upperX = std::min(w-1, upper[0] + radius[0]);
+
+        const short *ct = m_image->GetBufferPointer();
+        float *out = m_output->GetBufferPointer();
+        const size_t wh = (size_t)w * h;
+
+        // z pass: ct -> out, rows [lowerX,upperX] x [lowerY,upperY]
+        ParallelUtils::parallelFor(lower[2], upper[2]+1,
+            [&](size_t from, size_t to, unsigned) {
+                const std::vector<float> &kz = kernel[2];
+                for (int k = from; k < (int)to; ++k) {
+                    for (int j = lowerY; j <= upperY; ++j) {
+                        float *dst = out + k*wh + (size_t)j*w;
+                        for (int t = -radius[2]; t <= radius[2]; ++t) {
+                            int kk = std::min(d-1, std::max(0, k+t));
+                            const short *src = ct + kk*wh + (size_t)j*w;
+                            const float c = kz[t + radius[2]];
+                            for (int i = lowerX; i <= upperX; ++i)
+                                dst[i] += c * src[i];
+                        }
+                    }
+                }
+            });
+
+        // y pass: in place, rows [lowerX,upperX] x [lower[1],upper[1]]
+        ParallelUtils::parallelFor(lower[2], upper[2]+1,
+            [&](size_t from, size_t to, unsigned) {
+                const std::vector<float> &ky = kernel[1];
+                const int rowLength = upperX - lowerX + 1;
+                const int rows = upper[1] - lower[1] + 1;
+                std::vector<float> scratch((size_t)rowLength * rows);
+                for (int k = from; k < (int)to; ++k) {
+                    float *slice = out + k*wh;
+                    std::fill(scratch.begin(), scratch.end(), 0.0f);
+                    for (int j = lower[1]; j <= upper[1]; ++j) {
+                        float *dst = &scratch[(size_t)(j - lower[1]) * rowLength];
+                        for (int t = -radius[1]; t <= radius[1]; ++t) {
+                            int jj = std::min(h-1, std::max(0, j+t));
+                            const float *src = slice + (size_t)jj*w + lowerX;
+                            const float c = ky[t + radius[1]];
+                            for (int i = 0; i < rowLength; ++i)
+                                dst[i] += c * src[i];
+                        }
+                    }
+                    for (int j = lower[1]; j <= upper[1]; ++j) {
+                        std::copy(
+                            scratch.begin() + (size_t)(j - lower[1]) * rowLength,
+                            scratch.begin() + (size_t)(j - lower[1] + 1) * rowLength,
+                            slice + (size_t)j*w + lowerX);
+                    }
+                }
+            });
+
+        // x pass and unsharp masking: in place, the padded bounding box
+        ParallelUtils::parallelFor(lower[2], upper[2]+1,
+            [&](size_t from, size_t to, unsigned) {
+                const std::vector<float> &kx = kernel[0];
+                std::vector<float> line(w + 2*radius[0]);
+                for (int k = from; k < (int)to; ++k) {
+                    for (int j = lower[1]; j <= upper[1]; ++j) {
+                        float *row = out + k*wh + (size_t)j*w;
+                        const short *ctRow = ct + k*wh + (size_t)j*w;
+
+                        // row with clamped borders, line[i + radius] = row[i]
+                        for (int i = lower[0] - radius[0]; i <= upper[0] + radius[0]; ++i)
+                            line[i + radius[0]] = row[std::min(w-1, std::max(0, i))];
+
+                        for (int i = lower[0]; i <= upper[0]; ++i) {
+                            const float *src = &line[i];
+                            float blurred = 0;
+                            for (int t = 0; t < (int)kx.size(); ++t)
+                                blurred += kx[t] * src[t];
+                            float value = ctRow[i];
+                            row[i] = value + m_amount * (value - blurred);
+                        }
+                    }
+                }
+            });
+
+        // clear the intermediate results outside of the bounding box
+        if (lowerX < lower[0] || upperX > upper[0] || lowerY < lower[1] || upperY > upper[1]) {
+            for (int k = lower[2]; k <= upper[2]; ++k) {
+                for (int j = lowerY; j <= upperY; ++j) {
+                    float *row = out + k*wh + (size_t)j*w;
+                    if (j < lower[1] || j > upper[1]) {
+                        std::fill(row + lowerX, row + upperX + 1, 0.0f);
+                    } else {
+                        std::fill(row + lowerX, row + lower[0], 0.0f);
+                        std::fill(row + upper[0] + 1, row + upperX + 1, 0.0f);
+                    }
+                }
+            }
+        }
+    }
+
+
+private:
+
+    ShortImagePtr m_image;
+    UCharImagePtr m_roi;
+    FloatImagePtr m_output;
+    double m_variance;
+    float m_amount;
+    double m_roiMargin;
+
+
+
+    // coefficients of the gaussian along the given axis, as computed by
+    // itk::DiscreteGaussianImageFilter with its default settings
+    std::vector<float> gaussianKernel(unsigned dim) {
+        double spacing = m_image->GetSpacing()[dim];
+
+        itk::GaussianOperator<double, Dimension> op;
+        op.SetDirection(dim);
+        op.SetVariance(m_variance / (spacing * spacing));
+        op.SetMaximumError(0.01);
+        op.SetMaximumKernelWidth(32);
+        op.CreateDirectional();
+
+        unsigned length = op.GetSize(dim);
+        std::vector<float> kernel(length);
+        unsigned stride = op.GetStride(dim);
+        unsigned center = op.Size() / 2;
+        int radius = length / 2;
+        for (int t = -radius; t <= radius; ++t)
+            kernel[t + radius] = op[center + t*stride];
+
+        return kernel;
+    }
+
+
+
+    // bounding box of the ROI padded by ceil(margin/spacing)+2 voxels,
+    // clipped to the image. Returns false if the ROI is empty.
+    bool getPaddedROIBoundingBox(int lower[3], int upper[3]) {
+        ImageSize size = m_image->GetLargestPossibleRegion().GetSize();
+        FloatImage::SpacingType spacing = m_image->GetSpacing();
+
+        assert(m_roi->GetLargestPossibleRegion().GetSize() == size);
+
+        int w = size[0], h = size[1], d = size[2];
+        int lo[3] = { w, h, d };
+        int hi[3] = { -1, -1, -1 };
+
+        const unsigned char *roi = m_roi->GetBufferPointer();
+        for (int k = 0; k < d; ++k)
+            for (int j = 0; j < h; ++j) {
+                const unsigned char *row = roi + (size_t)j*w + (size_t)k*w*h;
+                for (int i = 0; i < w; ++i) {
+                    if (row[i] == 0)
+                        continue;
+                    lo[0] = std::min(lo[0], i); hi[0] = std::max(hi[0], i);
+                    lo[1] = std::min(lo[1], j); hi[1] = std::max(hi[1], j);
+                    lo[2] = std::min(lo[2], k); hi[2] = std::max(hi[2], k);
+                }
+            }
+
+        if (hi[0] < 0)
+            return false;
+
+        for (unsigned dim = 0; dim < 3; ++dim) {
+            int pad = (int)ceil(m_roiMargin / spacing[dim]) + 2;
+            lower[dim] = std::max(0, lo[dim] - pad);
+            upper[dim] = std::min((int)size[dim] - 1, hi[dim] + pad);
+        }
+        return true;
+    }
+
+};
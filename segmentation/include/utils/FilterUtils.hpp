@@ -23,9 +23,6 @@
 #include "itkImageDuplicator.h"
 #include "itkRegionOfInterestImageFilter.h"
 #include "itkCastImageFilter.h"
-#include "itkBinaryErodeImageFilter.h"
-#include "itkBinaryDilateImageFilter.h"
-#include "itkFlatStructuringElement.h"
 #include "itkBinaryThresholdImageFilter.h"
 #include "itkMaskImageFilter.h"
 #include "itkMaskNegatedImageFilter.h"
@@ -37,9 +34,16 @@
 #include "itkDiscreteGaussianImageFilter.h"
 #include "itkFastMarchingImageFilter.h"
 #include "itkPasteImageFilter.h"
+#include "itkBinShrinkImageFilter.h"
+#include "itkResampleImageFilter.h"
+#include "itkLinearInterpolateImageFunction.h"
+#include "itkNearestNeighborExtrapolateImageFunction.h"
 
 #include "ImageUtils.hpp"
+#include "EuclideanDistanceTransform.hpp"
+#include "ParallelUtils.hpp"
 #include <algorithm> //max,min
+#include <vector>
 
 template<class InputImage, class OutputImage = InputImage>
 class FilterUtils {
@@ -55,12 +59,8 @@ class FilterUtils {
     typedef typename OutputImage::PixelType OutputImagePixelType;
 
 
-    typedef itk::FlatStructuringElement< InputImage::ImageDimension > StructuringElementType;
-    typedef typename StructuringElementType::RadiusType StructuringElementTypeRadius;
 
     typedef itk::BinaryThresholdImageFilter<InputImage,OutputImage> BinaryThresholdFilter;
-    typedef itk::BinaryErodeImageFilter<InputImage, OutputImage, StructuringElementType > ErodeFilterType;
-    typedef itk::BinaryDilateImageFilter<InputImage, OutputImage, StructuringElementType > DilateFilterType;
     typedef itk::CastImageFilter <InputImage,OutputImage> CastImageFilterType;
     typedef itk::MaskImageFilter<InputImage,InputImage,OutputImage> MaskImageFilterType;
     typedef itk::MaskNegatedImageFilter<InputImage,InputImage,OutputImage> MaskNegatedImageFilterType;
@@ -74,8 +74,6 @@ class FilterUtils {
     typedef itk::PasteImageFilter<InputImage,OutputImage>  PasteImageFilterType;
 
     typedef typename BinaryThresholdFilter::Pointer BinaryThresholdFilterPointer;
-    typedef typename ErodeFilterType::Pointer ErodeFilterPointer;
-    typedef typename DilateFilterType::Pointer DilateFilterPointer;
     typedef typename CastImageFilterType::Pointer CastFilterPointer;
     typedef typename MaskImageFilterType::Pointer MaskImageFilterPointer;
     typedef typename MaskNegatedImageFilterType::Pointer MaskNegatedImageFilterPointer;
@@ -90,12 +88,50 @@ class FilterUtils {
     typedef ImageUtils<InputImage> InputImageUtils;
     typedef ImageUtils<OutputImage> OutputImageUtils;
 
+    typedef itk::Image<float, InputImage::ImageDimension> DistanceImage;
+    typedef typename DistanceImage::Pointer DistanceImagePointer;
+
     typedef typename FastMarchingImageFilterType::NodeContainer FastMarchingNodeContainer;
     typedef typename FastMarchingNodeContainer::Pointer FastMarchingNodeContainerPointer;
     typedef typename FastMarchingImageFilterType::NodeType FastMarchingNodeType;
 
 
 
+    // squared radius of itk::FlatStructuringElement::Ball, integer squared
+    // distances up to this value are within the ball
+    static float ballSquaredRadius(unsigned radius) {
+        return (radius + 0.5f) * (radius + 0.5f);
+    }
+
+
+
+    // output(p) = f(input(p), distance(p)), computed in parallel over slices
+    template<class Function>
+    static OutputImagePointer morphologyByThreshold(
+        InputImagePointer input, DistanceImagePointer distance, Function f
+    ) {
+        OutputImagePointer output = createEmptyFrom(input);
+
+        const InputImagePixelType *in = input->GetBufferPointer();
+        const float *dist = distance->GetBufferPointer();
+        OutputImagePixelType *out = output->GetBufferPointer();
+
+        typename InputImage::SizeType size = input->GetLargestPossibleRegion().GetSize();
+        size_t slice = 1;
+        for (unsigned dim = 0; dim + 1 < InputImage::ImageDimension; ++dim)
+            slice *= size[dim];
+
+        ParallelUtils::parallelFor(0, size[InputImage::ImageDimension - 1],
+            [&](size_t from, size_t to, unsigned) {
+                for (size_t i = from * slice; i < to * slice; ++i)
+                    out[i] = f(in[i], dist[i]);
+            });
+
+        return output;
+    }
+
+
+
 
 
 
@@ -168,6 +204,54 @@ public:
 
 
 
+    // downsample the image by averaging non-overlapping bins of
+    // factors[0] x factors[1] x ... pixels
+    static OutputImagePointer binShrink(
+        InputImagePointer image,
+        const itk::FixedArray<unsigned, InputImage::ImageDimension> & factors
+    ) {
+        typedef itk::BinShrinkImageFilter<InputImage,OutputImage> BinShrinkFilterType;
+        typedef typename BinShrinkFilterType::Pointer BinShrinkFilterPointer;
+
+        BinShrinkFilterPointer filter = BinShrinkFilterType::New();
+
+        filter->SetInput(image);
+        filter->SetShrinkFactors(factors);
+        filter->Update();
+
+        return filter->GetOutput();
+    }
+
+
+
+
+    // resample the image onto the grid of the reference image using linear
+    // interpolation, pixels beyond the image take the nearest pixel value
+    static OutputImagePointer resample(
+        InputImagePointer image, OutputImagePointer referenceImage
+    ) {
+        typedef itk::ResampleImageFilter<InputImage,OutputImage> ResampleFilterType;
+        typedef typename ResampleFilterType::Pointer ResampleFilterPointer;
+        typedef itk::LinearInterpolateImageFunction<InputImage> InterpolatorType;
+        typedef itk::NearestNeighborExtrapolateImageFunction<InputImage> ExtrapolatorType;
+
+        ResampleFilterPointer filter = ResampleFilterType::New();
+
+        filter->SetInput(image);
+        filter->SetInterpolator(InterpolatorType::New());
+        filter->SetExtrapolator(ExtrapolatorType::New());
+        filter->SetSize(referenceImage->GetLargestPossibleRegion().GetSize());
+        filter->SetOutputOrigin(referenceImage->GetOrigin());
+        filter->SetOutputSpacing(referenceImage->GetSpacing());
+        filter->SetOutputDirection(referenceImage->GetDirection());
+        filter->Update();
+
+        return filter->GetOutput();
+    }
+
+
+
+
     // relabel components according to its size.
     // Largest component 1, second largest 2, ...
     static OutputImagePointer relabelComponents(InputImagePointer image) {
@@ -324,46 +408,153 @@ public:
 
 
 
-    // perform erosion (mathematical morphology) with a given label image
-    // using a ball with a given radius
-    static OutputImagePointer erosion(
-        InputImagePointer labelImage, unsigned radius,
-        InputImagePixelType valueToErode = 1
+    // cast the image to the output type, clamping pixel values to
+    // [lowerThreshold, upperThreshold]. Unlike thresholding(), the input
+    // image is left untouched and no intermediate image is created.
+    static OutputImagePointer clampedCast(
+        InputImagePointer inputImage,
+        InputImagePixelType lowerThreshold,
+        InputImagePixelType upperThreshold
     ) {
+        OutputImagePointer output = createEmptyFrom(inputImage);
 
-        StructuringElementTypeRadius rad; rad.Fill(radius);
-        StructuringElementType K = StructuringElementType::Ball( rad );
+        itk::ImageRegionConstIterator<InputImage> itIn(
+            inputImage, inputImage->GetLargestPossibleRegion());
+        itk::ImageRegionIterator<OutputImage> itOut(
+            output, output->GetLargestPossibleRegion());
+        for (itIn.GoToBegin(), itOut.GoToBegin(); !itIn.IsAtEnd(); ++itIn, ++itOut) {
+            itOut.Set(
+                static_cast<OutputImagePixelType>(
+                    std::min(
+                        upperThreshold,
+                        std::max(itIn.Get(),lowerThreshold)
+                    )
+                )
+            );
+        }
+
+        return output;
+    }
 
-        ErodeFilterPointer erosionFilter = ErodeFilterType::New();
-        erosionFilter->SetKernel(K);
-        erosionFilter->SetErodeValue(valueToErode);
 
-        erosionFilter->SetInput( labelImage );
-        erosionFilter->Update();
 
-        return erosionFilter->GetOutput();
-    }
 
+    /*
+    Erosion and dilation (mathematical morphology) of the pixels with the
+    given value using a ball with a given radius. The ball is the same as
+    itk::FlatStructuringElement::Ball, i.e. all offsets d (in pixels) with
+
+        |d|^2 <= (radius + 0.5)^2,
+
+    and the results are the same as of itk::BinaryErodeImageFilter and
+    itk::BinaryDilateImageFilter with this kernel (the border of the image
+    is foreground for the erosion). Both are computed by thresholding the
+    exact squared euclidean distance in pixels, so the time does not depend
+    on the radius and the work is split between threads.
+    */
+    static OutputImagePointer erosion(
+        InputImagePointer labelImage, unsigned radius,
+        InputImagePixelType valueToErode = 1
+    ) {
+        // minus squared distance of the pixels with the value to the
+        // nearest other pixel
+        EuclideanDistanceTransform<InputImage, DistanceImage> edt;
+        edt.setUseImageSpacing(false);
+        edt.setSquaredDistance(true);
+        edt.setSigned(true);
+        edt.setObjectLabel(valueToErode);
+        edt.setMaximumDistance(radius + 1);
+        DistanceImagePointer distance = edt.compute(labelImage);
+
+        float ball = ballSquaredRadius(radius);
+        return morphologyByThreshold(labelImage, distance,
+            [&](InputImagePixelType value, float d) -> OutputImagePixelType {
+                if (value == valueToErode && -d <= ball)
+                    return 0;
+                return value;
+            });
+    }
 
 
 
-    // perform erosion (mathematical morphology) with a given label image
-    // using a ball with a given radius
     static OutputImagePointer dilation(
         InputImagePointer labelImage, unsigned radius,
         InputImagePixelType valueToDilate = 1
     ) {
-        StructuringElementTypeRadius rad; rad.Fill(radius);
-        StructuringElementType K = StructuringElementType::Ball( rad );
+        // squared distance to the nearest pixel with the value
+        EuclideanDistanceTransform<InputImage, DistanceImage> edt;
+        edt.setUseImageSpacing(false);
+        edt.setSquaredDistance(true);
+        edt.setObjectLabel(valueToDilate);
+        edt.setMaximumDistance(radius + 1);
+        DistanceImagePointer distance = edt.compute(labelImage);
+
+        float ball = ballSquaredRadius(radius);
+        return morphologyByThreshold(labelImage, distance,
+            [&](InputImagePixelType value, float d) -> OutputImagePixelType {
+                if (d <= ball)
+                    return valueToDilate;
+                return value;
+            });
+    }
 
-        DilateFilterPointer dilateFilter  = DilateFilterType::New();
-        dilateFilter->SetKernel(K);
-        dilateFilter->SetDilateValue(valueToDilate);
 
-        dilateFilter->SetInput( labelImage );
-        dilateFilter->Update();
 
-        return dilateFilter->GetOutput();
+
+    // binary mask (0/1) of all pixels within city-block (Manhattan)
+    // distance radius from a nonzero pixel of the image, i.e. the same as
+    // thresholding the Manhattan chamfer distance to [0,radius]. Computed
+    // by a breadth-first search over 6-neighbours stopping at the radius,
+    // so only pixels near the object are visited.
+    static OutputImagePointer boundedDilation(
+        InputImagePointer image, unsigned radius
+    ) {
+        OutputImagePointer output = createEmptyFrom(image);
+
+        typename InputImage::SizeType size =
+            image->GetLargestPossibleRegion().GetSize();
+        const long w = size[0], h = size[1], d = size[2];
+        const long wh = w * h;
+
+        const InputImagePixelType *in = image->GetBufferPointer();
+        OutputImagePixelType *out = output->GetBufferPointer();
+
+        // the object itself is the first frontier
+        std::vector<long> frontier, next;
+        const long total = wh * d;
+        for (long i = 0; i < total; ++i) {
+            if (in[i] != 0) {
+                out[i] = 1;
+                frontier.push_back(i);
+            }
+        }
+
+        for (unsigned distance = 1; distance <= radius && !frontier.empty(); ++distance) {
+            next.clear();
+            for (size_t n = 0; n < frontier.size(); ++n) {
+                const long i = frontier[n];
+                const long x = i % w, y = (i / w) % h, z = i / wh;
+
+                const long neighbours[6] = {
+                    (x > 0)   ? i - 1  : -1,
+                    (x < w-1) ? i + 1  : -1,
+                    (y > 0)   ? i - w  : -1,
+                    (y < h-1) ? i + w  : -1,
+                    (z > 0)   ? i - wh : -1,
+                    (z < d-1) ? i + wh : -1
+                };
+                for (unsigned k = 0; k < 6; ++k) {
+                    const long j = neighbours[k];
+                    if (j < 0 || out[j] != 0)
+                        continue;
+                    out[j] = 1;
+                    next.push_back(j);
+                }
+            }
+            frontier.swap(next);
+        }
+
+        return output;
     }
 
 
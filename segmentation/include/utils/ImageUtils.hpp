@@ -112,6 +112,16 @@ public:
     }
 
 
+    /* Copy a region of the image into a new image starting at index 0 */
+    static ImagePointerType crop(ImagePointerType img, RegionType region) {
+        ROIFilterPointerType roiFilter = ROIFilterType::New();
+        roiFilter->SetInput(img);
+        roiFilter->SetRegionOfInterest(region);
+        roiFilter->Update();
+        return roiFilter->GetOutput();
+    }
+
+
     static ImagePointerType duplicate(ImagePointerType img) {
        DuplicatorPointerType duplicator = DuplicatorType::New();
        duplicator->SetInputImage( img );
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <algorithm> //max,min
+#include <cstddef>
+
+/*
+Minimal helpers for splitting loops over image slices/rows between threads.
+Work is split into contiguous chunks, one per thread, so that every thread
+touches a contiguous part of the image buffer.
+*/
+class ParallelUtils {
+
+public:
+
+    // number of threads used by parallelFor
+    static unsigned numberOfThreads() {
+        unsigned n = std::thread::hardware_concurrency();
+        return std::max(1u, n);
+    }
+
+
+
+    // call f(from, to, threadId) on disjoint chunks [from,to) covering
+    // [begin,end). The calling thread processes the first chunk.
+    template<class Function>
+    static void parallelFor(size_t begin, size_t end, Function f) {
+
+        if (end <= begin) return;
+
+        size_t total = end - begin;
+        size_t nThreads = std::min<size_t>(numberOfThreads(), total);
+        size_t chunk = (total + nThreads - 1) / nThreads;
+
+        std::vector<std::thread> threads;
+        for (size_t t = 1; t < nThreads; ++t) {
+            size_t from = begin + t * chunk;
+            size_t to = std::min(end, from + chunk);
+            if (from >= to) break;
+            threads.push_back(std::thread(f, from, to, (unsigned) t));
+        }
+
+        f(begin, std::min(end, begin + chunk), 0u);
+
+        for (size_t t = 0; t < threads.size(); ++t) {
+            threads[t].join();
+        }
+    }
+
+
+
+    // call f(task, threadId) for task = 0..nTasks-1. Tasks are handed out
+    // in increasing order to the first idle thread, so the order in which
+    // they finish is not deterministic.
+    template<class Function>
+    static void parallelTasks(size_t nTasks, Function f) {
+
+        std::atomic<size_t> nextTask(0);
+        auto worker = [&](unsigned threadId) {
+            for (size_t task = nextTask++; task < nTasks; task = nextTask++)
+                f(task, threadId);
+        };
+
+        size_t nThreads = std::min<size_t>(numberOfThreads(), nTasks);
+        std::vector<std::thread> threads;
+        for (size_t t = 1; t < nThreads; ++t) {
+            threads.push_back(std::thread(worker, (unsigned) t));
+        }
+
+        worker(0u);
+
+        for (size_t t = 0; t < threads.size(); ++t) {
+            threads[t].join();
+        }
+    }
+
+};
+
+
+
+
+/*
+Memory shared by concurrently running tasks. A task reserves its expected
+memory before it starts and waits while the reservation would exceed the
+budget. A task larger than the whole budget runs once nothing else does.
+*/
+class MemoryBudget {
+
+    std::mutex m_mutex;
+    std::condition_variable m_released;
+    double m_availableMb;
+    double m_usedMb;
+    unsigned m_running;
+
+public:
+
+    MemoryBudget(double availableMb) :
+        m_availableMb(availableMb), m_usedMb(0), m_running(0) {}
+
+    void acquire(double mb) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_running > 0 && m_usedMb + mb > m_availableMb)
+            m_released.wait(lock);
+        m_usedMb += mb;
+        m_running++;
+    }
+
+    void release(double mb) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_usedMb -= mb;
+            m_running--;
+        }
+        m_released.notify_all();
+    }
+
+};
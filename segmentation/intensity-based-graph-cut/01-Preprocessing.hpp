@@ -20,8 +20,8 @@
 #include "Globals.hpp"
 #include "ImageUtils.hpp"
 #include "FilterUtils.hpp"
+#include "ConnectedComponents.hpp"
 #include "SheetnessMeasure.hpp"
-#include "ChamferDistanceTransform.hpp"
 #include "boost/tuple/tuple.hpp"
 
 
@@ -54,8 +54,8 @@ FloatImagePtr multiscaleSheetness(
         sheetnessFilter->SetObjectDimension(2);
         sheetnessFilter->SetBrightObject(true);
         sheetnessFilter->ScaleObjectnessMeasureOff();
-        sheetnessFilter->Update();
         sheetnessFilter->SetROIImage(roi);
+        sheetnessFilter->Update();
 
         FloatImagePtr singleScaleSheetness = sheetnessFilter->GetOutput();
 
@@ -91,14 +91,6 @@ FloatImagePtr multiscaleSheetness(
 
 
 
-FloatImagePtr chamferDistance(UCharImagePtr image) {
-    typedef ChamferDistanceTransform<UCharImage, FloatImage> CDT;
-    CDT cdt;
-    return cdt.compute(image, CDT::MANHATTEN);
-}
-
-
-
 /*
 Input: Normalized CT image, scales for the sheetness measure
 Output: (ROI, MultiScaleSheetness, SoftTissueEstimation)
@@ -116,14 +108,10 @@ compute(
     {
 
         log("Estimating soft-tissue voxels");
-        softTissueEstimation =  FilterUtils<UIntImage,UCharImage>::binaryThresholding(
-                FilterUtils<UIntImage>::relabelComponents(
-                    FilterUtils<UCharImage, UIntImage>::connectedComponents(
-                    FilterUtils<ShortImage,UCharImage>::binaryThresholding(
-                        inputCT, -5000, -50)
-                    )),
-                1,1
-            );
+        softTissueEstimation =
+            ConnectedComponents<UCharImage>::largestComponent<UCharImage>(
+                FilterUtils<ShortImage,UCharImage>::binaryThresholding(
+                    inputCT, -5000, -50));
 
 
         log("Estimating bone voxels");
@@ -139,9 +127,8 @@ compute(
             boneEstimation->SetPixel(it.GetIndex(), bone ? 1 : 0);
         }
 
-        log("Computing ROI from bone estimation using Chamfer Distance");
-        roi = FilterUtils<FloatImage,UCharImage>::binaryThresholding(
-            chamferDistance(boneEstimation),0, 30);
+        log("Computing ROI as bone estimation dilated by 30 voxels");
+        roi = FilterUtils<UCharImage>::boundedDilation(boneEstimation, 30);
     }
 
     return make_tuple(roi, softTissueEstimation);
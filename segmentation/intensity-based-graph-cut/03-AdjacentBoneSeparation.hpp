@@ -24,6 +24,10 @@
 #include "GraphCut.hpp"
 #include "ImageUtils.hpp"
 #include "FilterUtils.hpp"
+#include "EuclideanDistanceTransform.hpp"
+#include "ConnectedComponents.hpp"
+#include "ParallelUtils.hpp"
+#include <set>
 #include "Globals.hpp"
 
 
@@ -230,28 +234,78 @@ vector<Label> getIslandLabelsSortedBySize(
 
 
 /**
-True if there's a pixel with intensity @label in the image
-whose distance is less than @maxDistance.
-*/
-bool isIslandWithinDistance(
-    UIntImagePtr image,
-    FloatImagePtr distanceImage,
-    Label label, float maxDistance
-) {
-    itk::ImageRegionIteratorWithIndex<UIntImage> it(
-        image, image->GetLargestPossibleRegion());
-    for (it.GoToBegin(); !it.IsAtEnd(); ++it) {
+Unordered pairs of labels (smaller label first) of sub-islands which are
+closer to each other than maxDistance. Only sub-islands with a nonzero
+label in activeIslands are considered.
 
-        if (it.Get() != label)
-            continue;
+The nearest-island label is propagated to all pixels by one Euclidean
+distance transform (restricted to a band of maxDistance). Two islands
+are adjacent if their Voronoi regions touch at neighbouring pixels p,q with
 
-        float distance = distanceImage->GetPixel(it.GetIndex());
+    dist(p) + |p-q| + dist(q) < maxDistance,
 
-        if (distance < maxDistance)
-            return true;
+which bounds the distance between the islands from above. Compared to
+the exact island-to-island distance, this may miss pairs whose distance is
+within about one pixel of maxDistance, or whose closest points are
+separated by a third island.
+*/
+set<pair<Label, Label> > getAdjacentIslands(
+    UIntImagePtr activeIslands,
+    float maxDistance
+) {
 
-    }
-    return false;
+    EuclideanDistanceTransform<UIntImage, FloatImage> edt;
+    edt.setPropagation(true);
+    edt.setMaximumDistance(maxDistance);
+    FloatImagePtr distanceImage = edt.compute(activeIslands);
+    UIntImagePtr nearestIsland = edt.getPropagationImage();
+
+    ImageSize size = activeIslands->GetLargestPossibleRegion().GetSize();
+    UIntImage::SpacingType spacing = activeIslands->GetSpacing();
+    const long w = size[0], h = size[1], d = size[2];
+    const long strides[3] = { 1, w, w * h };
+
+    const float *distance = distanceImage->GetBufferPointer();
+    const Label *nearest = nearestIsland->GetBufferPointer();
+
+    // each thread collects pairs from its slices
+    vector<set<pair<Label, Label> > > threadPairs(ParallelUtils::numberOfThreads());
+
+    ParallelUtils::parallelFor(0, d,
+        [&](size_t from, size_t to, unsigned threadId) {
+            set<pair<Label, Label> > &pairs = threadPairs[threadId];
+            for (long z = from; z < (long)to; ++z)
+                for (long y = 0; y < h; ++y)
+                    for (long x = 0; x < w; ++x) {
+                        long p = x + y * strides[1] + z * strides[2];
+                        Label labelP = nearest[p];
+                        if (labelP == 0 || distance[p] >= maxDistance)
+                            continue;
+
+                        const long coords[3] = { x, y, z };
+                        const long extent[3] = { w, h, d };
+                        for (unsigned dim = 0; dim < 3; ++dim) {
+                            if (coords[dim] + 1 >= extent[dim])
+                                continue;
+                            long q = p + strides[dim];
+                            Label labelQ = nearest[q];
+                            if (labelQ == 0 || labelQ == labelP)
+                                continue;
+
+                            float estimate = distance[p] + spacing[dim] + distance[q];
+                            if (estimate < maxDistance) {
+                                pairs.insert(pair<Label, Label>(
+                                    std::min(labelP, labelQ), std::max(labelP, labelQ)));
+                            }
+                        }
+                    }
+        });
+
+    set<pair<Label, Label> > adjacent;
+    for (unsigned t = 0; t < threadPairs.size(); ++t)
+        adjacent.insert(threadPairs[t].begin(), threadPairs[t].end());
+
+    return adjacent;
 }
 
 
@@ -268,7 +322,7 @@ Distinguish which subIslands are close to each other enough so it makes
 sense to find bottleneck between them.
 
 Two islands are considered "close to each other" if their
-distance is smaller than maxDistance
+distance is smaller than maxDistance (see getAdjacentIslands)
 */
 vector<pair<Label, Label> > getSubIslandsPairsForSeparation(
     const IslandStats &stats,
@@ -278,12 +332,46 @@ vector<pair<Label, Label> > getSubIslandsPairsForSeparation(
 
     vector<pair<Label, Label> > pairs;
 
-    // each main label
+    // sub-islands which take part in the separation
+    set<Label> activeLabels;
     const map<Label, IslandStats> & mainIslandsMap = stats.subIslands;
     map<Label,IslandStats>::const_iterator it;
     for ( it = mainIslandsMap.begin() ; it != mainIslandsMap.end(); it++ ) {
+        if (it->second.active == false)
+            continue;
 
-        IslandStats  mainIslandStats = it->second;
+        map<Label,IslandStats>::const_iterator subIt;
+        for (
+            subIt = it->second.subIslands.begin();
+            subIt != it->second.subIslands.end();
+            subIt++
+        ) {
+            if (subIt->second.active)
+                activeLabels.insert(subIt->first);
+        }
+    }
+
+    if (activeLabels.empty())
+        return pairs;
+
+    log("Computing distances from %d sub-islands") % activeLabels.size();
+
+    UIntImagePtr activeIslands = ImageUtils<UIntImage>::duplicate(subIslandsImage);
+    Label *label = activeIslands->GetBufferPointer();
+    size_t total = activeIslands->GetLargestPossibleRegion().GetNumberOfPixels();
+    for (size_t i = 0; i < total; ++i) {
+        if (label[i] != 0 && activeLabels.find(label[i]) == activeLabels.end())
+            label[i] = 0;
+    }
+
+    set<pair<Label, Label> > adjacent =
+        getAdjacentIslands(activeIslands, maxDistance);
+    activeIslands = 0;
+
+    // each main label, pairs ordered as (smaller island, larger island)
+    for ( it = mainIslandsMap.begin() ; it != mainIslandsMap.end(); it++ ) {
+
+        const IslandStats & mainIslandStats = it->second;
 
         // skip islands which should not be process
         if (mainIslandStats.active == false)
@@ -302,21 +390,15 @@ vector<pair<Label, Label> > getSubIslandsPairsForSeparation(
         ) {
 
             Label subIsland = subIslandsSortedBySize[mainIdx];
-            log("Computing distace from sub-island %d") % subIsland;
-
-            FloatImagePtr distance =
-                FilterUtils<UIntImage,FloatImage>::distanceMapByFastMarcher(
-                    subIslandsImage, subIsland, maxDistance + 1);
 
             for (unsigned i=mainIdx+1; i < subIslandsSortedBySize.size(); ++i) {
                 Label potentialAdjacentSubIsland = subIslandsSortedBySize[i];
 
-                bool islandsAdjacent = isIslandWithinDistance(
-                    subIslandsImage, distance,
-                    potentialAdjacentSubIsland, maxDistance
-                );
+                pair<Label, Label> key(
+                    std::min(subIsland, potentialAdjacentSubIsland),
+                    std::max(subIsland, potentialAdjacentSubIsland));
 
-                if (islandsAdjacent) {
+                if (adjacent.count(key)) {
                     pairs.push_back(
                         pair<Label,Label>(subIsland,potentialAdjacentSubIsland)
                     );
@@ -450,15 +532,14 @@ UCharImagePtr compute(UCharImagePtr inputBinary) {
     unsigned EROSION_RADIUS = 3;
     unsigned MAX_DISTANCE_FOR_ADJACENT_BONES = 15;
 
+    ConnectedComponents<UCharImage> connectedComponents;
+
     log("Computing Connected Components");
-    UIntImagePtr mainIslands =
-        FilterUtils<UCharImage,UIntImage>::connectedComponents(inputBinary);
+    UIntImagePtr mainIslands = connectedComponents.compute(inputBinary);
 
     log("Erosion + Connected Components, ball radius=%d") % EROSION_RADIUS;
-    UIntImagePtr subIslands =
-        FilterUtils<UCharImage,UIntImage>::connectedComponents(
-            FilterUtils<UCharImage>::erosion(inputBinary, EROSION_RADIUS)
-        );
+    UIntImagePtr subIslands = connectedComponents.compute(
+        FilterUtils<UCharImage>::erosion(inputBinary, EROSION_RADIUS));
 
 
     /*
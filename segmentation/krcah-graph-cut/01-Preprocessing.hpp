@@ -20,8 +20,9 @@
 #include "Globals.hpp"
 #include "ImageUtils.hpp"
 #include "FilterUtils.hpp"
+#include "ConnectedComponents.hpp"
 #include "SheetnessMeasure.hpp"
-#include "ChamferDistanceTransform.hpp"
+#include "UnsharpMasking.hpp"
 #include "boost/tuple/tuple.hpp"
 
 
@@ -54,8 +55,8 @@ FloatImagePtr multiscaleSheetness(
         sheetnessFilter->SetObjectDimension(2);
         sheetnessFilter->SetBrightObject(true);
         sheetnessFilter->ScaleObjectnessMeasureOff();
-        sheetnessFilter->Update();
         sheetnessFilter->SetROIImage(roi);
+        sheetnessFilter->Update();
 
         FloatImagePtr singleScaleSheetness = sheetnessFilter->GetOutput();
 
@@ -91,10 +92,129 @@ FloatImagePtr multiscaleSheetness(
 
 
 
-FloatImagePtr chamferDistance(UCharImagePtr image) {
-    typedef ChamferDistanceTransform<UCharImage, FloatImage> CDT;
-    CDT cdt;
-    return cdt.compute(image, CDT::MANHATTEN);
+// compute single-scale sheetness on a downsampled copy of the image and
+// upsample it back to the grid of the image. Along each axis, the image is
+// downsampled by the largest factor (at most 4) for which sigma still covers
+// 0.75 of the coarse voxel. Hessians are scaled back to the units of the
+// original grid, so the measure is comparable to the full-resolution one.
+FloatImagePtr pyramidSheetness(FloatImagePtr img, float sigma) {
+
+    FloatImage::SpacingType spacing = img->GetSpacing();
+
+    itk::FixedArray<unsigned, Dimension> factors;
+    MemoryEfficientObjectnessFilter::VectorType hessianScaling;
+    bool downsample = false;
+    for (unsigned dim = 0; dim < Dimension; ++dim) {
+        unsigned factor = (unsigned) floor(sigma / (0.75 * spacing[dim]));
+        factors[dim] = std::max(1u, std::min(4u, factor));
+        hessianScaling[dim] = 1.0 / factors[dim];
+        downsample = downsample || (factors[dim] > 1);
+    }
+
+    if (!downsample) {
+        log("Sigma too small for downsampling, computing at full resolution");
+        vector<float> scales; scales.push_back(sigma);
+        return multiscaleSheetness(img, scales);
+    }
+
+    log("Computing single-scale sheetness, sigma=%4.2f, downsampled %dx%dx%d")
+        % sigma % factors[0] % factors[1] % factors[2];
+
+    MemoryEfficientObjectnessFilter *sheetnessFilter =
+        new MemoryEfficientObjectnessFilter();
+    sheetnessFilter->SetImage(FilterUtils<FloatImage>::binShrink(img, factors));
+    sheetnessFilter->SetAlpha(0.5);
+    sheetnessFilter->SetBeta(0.5);
+    sheetnessFilter->SetSigma(sigma);
+    sheetnessFilter->SetObjectDimension(2);
+    sheetnessFilter->SetBrightObject(true);
+    sheetnessFilter->ScaleObjectnessMeasureOff();
+    sheetnessFilter->SetHessianScaling(hessianScaling);
+    sheetnessFilter->Update();
+
+    log("Upsampling sheetness to the full resolution");
+    FloatImagePtr sheetness =
+        FilterUtils<FloatImage>::resample(sheetnessFilter->GetOutput(), img);
+
+    delete sheetnessFilter;
+    return sheetness;
+}
+
+
+
+// log how well the approximated sheetness matches the reference one,
+// both in values and in the thresholds used by the preprocessing
+void reportSheetnessAccuracy(FloatImagePtr approximation, FloatImagePtr reference) {
+
+    itk::ImageRegionConstIterator<FloatImage>
+        itApprox(approximation, approximation->GetLargestPossibleRegion());
+    itk::ImageRegionConstIterator<FloatImage>
+        itRef(reference, reference->GetLargestPossibleRegion());
+
+    double sumDiff = 0;
+    float maxDiff = 0;
+    unsigned long total = 0, softTissueMismatch = 0, boneMismatch = 0;
+
+    for (
+            itApprox.GoToBegin(), itRef.GoToBegin();
+            !itApprox.IsAtEnd();
+            ++itApprox, ++itRef
+        ) {
+            float a = itApprox.Get();
+            float r = itRef.Get();
+            float diff = fabs(a - r);
+
+            sumDiff += diff;
+            maxDiff = std::max(maxDiff, diff);
+            total++;
+
+            if ((fabs(a) <= 0.05) != (fabs(r) <= 0.05))
+                softTissueMismatch++;
+            if ((a > 0.6) != (r > 0.6))
+                boneMismatch++;
+    }
+
+    log("Sheetness accuracy: mean abs. error %1%, max abs. error %2%")
+        % (sumDiff / total) % maxDiff;
+    log("Sheetness accuracy: %5.3f%% voxels differ in |s|<=0.05, %5.3f%% in s>0.6")
+        % (100.0 * softTissueMismatch / total) % (100.0 * boneMismatch / total);
+}
+
+
+
+/*
+Single pass over the input CT and the small-scale sheetness.
+Output: (BoneEstimation, SoftTissueCandidates)
+
+    bone voxels:                 hu > 400 or (hu > 250 and sheetness > 0.6)
+    soft-tissue candidates:      |sheetness| <= 0.05
+*/
+tuple<UCharImagePtr, UCharImagePtr>
+estimateBoneAndSoftTissue(ShortImagePtr inputCT, FloatImagePtr sheetness) {
+
+    UCharImagePtr boneEstimation =
+        FilterUtils<ShortImage,UCharImage>::createEmptyFrom(inputCT);
+    UCharImagePtr softTissueCandidates =
+        FilterUtils<ShortImage,UCharImage>::createEmptyFrom(inputCT);
+
+    assert(sheetness->GetLargestPossibleRegion().GetSize() ==
+        inputCT->GetLargestPossibleRegion().GetSize());
+
+    const short *hu = inputCT->GetBufferPointer();
+    const float *s = sheetness->GetBufferPointer();
+    unsigned char *bone = boneEstimation->GetBufferPointer();
+    unsigned char *softTissue = softTissueCandidates->GetBufferPointer();
+
+    const float lower = -0.05;
+    const float upper = +0.05;
+
+    size_t total = inputCT->GetLargestPossibleRegion().GetNumberOfPixels();
+    for (size_t i = 0; i < total; ++i) {
+        bone[i] = (hu[i] > 400) || ( hu[i] > 250 && s[i] > 0.6 );
+        softTissue[i] = (s[i] >= lower && s[i] <= upper);
+    }
+
+    return make_tuple(boneEstimation, softTissueCandidates);
 }
 
 
@@ -102,12 +222,19 @@ FloatImagePtr chamferDistance(UCharImagePtr image) {
 /*
 Input: Normalized CT image, scales for the sheetness measure
 Output: (ROI, MultiScaleSheetness, SoftTissueEstimation)
+
+If smallScalePyramid is true, the small-scale sheetness is computed on a
+downsampled image (see pyramidSheetness). If also reportPyramidAccuracy is
+true, it is compared against the full-resolution sheetness (which is then
+computed as well).
 */
 tuple<UCharImagePtr, FloatImagePtr, UCharImagePtr>
 compute(
     ShortImagePtr inputCT,
     float sigmaSmallScale,
-    vector<float> sigmasLargeScale
+    vector<float> sigmasLargeScale,
+    bool smallScalePyramid = false,
+    bool reportPyramidAccuracy = false
 ) {
 
     UCharImagePtr roi;
@@ -116,58 +243,55 @@ compute(
 
     {
         log("Thresholding input image");
-        ShortImagePtr thresholdedInputCT =
-            FilterUtils<ShortImage>::thresholding(
-                ImageUtils<ShortImage>::duplicate(inputCT),
-                25, 600
-            );
+        FloatImagePtr thresholdedInputCT =
+            FilterUtils<ShortImage,FloatImage>::clampedCast(inputCT, 25, 600);
 
         vector<float> scales; scales.push_back(sigmaSmallScale);
-        FloatImagePtr smallScaleSheetnessImage =
-            multiscaleSheetness(
-                FilterUtils<ShortImage,FloatImage>::cast(thresholdedInputCT),
-                scales
-            );
+        FloatImagePtr smallScaleSheetnessImage;
+        if (smallScalePyramid) {
+            smallScaleSheetnessImage =
+                pyramidSheetness(thresholdedInputCT, sigmaSmallScale);
+
+            if (reportPyramidAccuracy) {
+                reportSheetnessAccuracy(
+                    smallScaleSheetnessImage,
+                    multiscaleSheetness(thresholdedInputCT, scales));
+            }
+        } else {
+            smallScaleSheetnessImage =
+                multiscaleSheetness(thresholdedInputCT, scales);
+        }
+        thresholdedInputCT = 0;
+
+        log("Estimating bone and soft-tissue voxels");
+        UCharImagePtr boneEstimation;
+        UCharImagePtr softTissueCandidates;
+        boost::tie(boneEstimation, softTissueCandidates) =
+            estimateBoneAndSoftTissue(inputCT, smallScaleSheetnessImage);
+        smallScaleSheetnessImage = 0;
 
         log("Estimating soft-tissue voxels");
-        softTissueEstimation =  FilterUtils<UIntImage,UCharImage>::binaryThresholding(
-                FilterUtils<UIntImage>::relabelComponents(
-                    FilterUtils<UCharImage, UIntImage>::connectedComponents(
-                    FilterUtils<FloatImage,UCharImage>::binaryThresholding(
-                        smallScaleSheetnessImage, -0.05, +0.05)
-                    )),
-                1,1
-            );
-
-        log("Estimating bone voxels");
-        UCharImagePtr boneEstimation =
-            FilterUtils<ShortImage,UCharImage>::createEmptyFrom(inputCT);
-        itk::ImageRegionIteratorWithIndex<ShortImage>
-            it(inputCT,inputCT->GetLargestPossibleRegion());
-        for (it.GoToBegin(); !it.IsAtEnd(); ++it) {
-            short hu = it.Get();
-            float sheetness = smallScaleSheetnessImage->GetPixel(it.GetIndex());
-
-            bool bone = (hu > 400) || ( hu > 250 && sheetness > 0.6 );
-
-            boneEstimation->SetPixel(it.GetIndex(), bone ? 1 : 0);
-        }
+        softTissueEstimation =
+            ConnectedComponents<UCharImage>::largestComponent<UCharImage>(
+                softTissueCandidates);
+        softTissueCandidates = 0;
 
-        log("Computing ROI from bone estimation using Chamfer Distance");
-        roi = FilterUtils<FloatImage,UCharImage>::binaryThresholding(
-            chamferDistance(boneEstimation),0, 30);
+        log("Computing ROI as bone estimation dilated by 30 voxels");
+        roi = FilterUtils<UCharImage>::boundedDilation(boneEstimation, 30);
     }
 
+    // only the part of the unsharp-masked image read by the sheetness
+    // filter (the ROI padded by the largest sigma) is computed
     log("Unsharp masking");
-    FloatImagePtr inputCTUnsharpMasked =
-        FilterUtils<FloatImage>::add(
-            FilterUtils<ShortImage,FloatImage>::cast(inputCT),
-            FilterUtils<FloatImage>::linearTransform(
-                FilterUtils<FloatImage>::substract(
-                    FilterUtils<ShortImage,FloatImage>::cast(inputCT),
-                    FilterUtils<ShortImage,FloatImage>::gaussian(inputCT, 1.0)),
-                10.0, 0.0)
-        );
+    UnsharpMaskingFilter unsharpMasking;
+    unsharpMasking.SetImage(inputCT);
+    unsharpMasking.SetVariance(1.0);
+    unsharpMasking.SetAmount(10.0);
+    unsharpMasking.SetROIImage(roi);
+    unsharpMasking.SetROIMargin(
+        4.0 * *std::max_element(sigmasLargeScale.begin(), sigmasLargeScale.end()));
+    unsharpMasking.Update();
+    FloatImagePtr inputCTUnsharpMasked = unsharpMasking.GetOutput();
 
     log("Computing multiscale sheetness measure at %d scales")
         % sigmasLargeScale.size();
@@ -22,8 +22,13 @@
 
 
 #include "GraphCut.hpp"
+#include "AlphaExpansion.hpp"
 #include "ImageUtils.hpp"
 #include "FilterUtils.hpp"
+#include "EuclideanDistanceTransform.hpp"
+#include "ConnectedComponents.hpp"
+#include "ParallelUtils.hpp"
+#include <set>
 #include "Globals.hpp"
 
 
@@ -31,6 +36,7 @@ namespace BoneSeparation {
 
 
 typedef GraphCutSegmentation<Dimension> GCSegm;
+typedef AlphaExpansionSegmentation<Dimension> AESegm;
 
 
 /** Label of an island */
@@ -44,20 +50,8 @@ typedef pair<Label, unsigned> PairLabelSize;
 
 /**
 Info about one island.
-
-This is a recursive structure:
-
-    IslandStats
-        info about the whole image,
-
-    IslandStats.subIslands[x]
-        info about mainIsland labelled x
-
-    IslandStats.subIslands[x].subIslands[y]
-        info about subIsland labelled y within x
-
 */
-struct IslandStats {
+struct IslandInfo {
 
     // number of pixels in the island
     unsigned count;
@@ -65,65 +59,171 @@ struct IslandStats {
     // should this island be processed by the graph-cut separation?
     bool active;
 
-    map<Label, IslandStats> subIslands;
+    // label of the main island containing this sub-island
+    // (0 for main islands)
+    Label mainLabel;
+
+    // bounding box of the island, valid if count > 0
+    ImageIndex lower, upper;
 
     // constructor
-    IslandStats() : count(0), active(false) {}
+    IslandInfo() : count(0), active(false), mainLabel(0) {}
 
-};
+    void addPixel(const ImageIndex & idx) {
+        if (count == 0) {
+            lower = idx;
+            upper = idx;
+        }
+        for (unsigned dim = 0; dim < Dimension; ++dim) {
+            lower[dim] = std::min(lower[dim], idx[dim]);
+            upper[dim] = std::max(upper[dim], idx[dim]);
+        }
+        count++;
+    }
 
+    void merge(const IslandInfo & other) {
+        if (other.count == 0)
+            return;
+        if (count == 0) {
+            *this = other;
+            return;
+        }
+        assert(mainLabel == other.mainLabel);
+        for (unsigned dim = 0; dim < Dimension; ++dim) {
+            lower[dim] = std::min(lower[dim], other.lower[dim]);
+            upper[dim] = std::max(upper[dim], other.upper[dim]);
+        }
+        count += other.count;
+    }
 
+    // bounding box padded by @padding pixels, clipped to @largestRegion
+    ImageRegion getBoundingBox(unsigned padding, const ImageRegion & largestRegion) const {
+        ImageRegion region;
+        ImageIndex start;
+        ImageSize size;
+        for (unsigned dim = 0; dim < Dimension; ++dim) {
+            long from = std::max<long>(
+                largestRegion.GetIndex()[dim], lower[dim] - (long)padding);
+            long to = std::min<long>(
+                largestRegion.GetIndex()[dim] + largestRegion.GetSize()[dim] - 1,
+                upper[dim] + (long)padding);
+            start[dim] = from;
+            size[dim] = to - from + 1;
+        }
+        region.SetIndex(start);
+        region.SetSize(size);
+        return region;
+    }
 
+};
 
 
 
 /**
-Compute sizes of main islands and the corresponding subislands
+Index of main islands and sub-islands. Islands are stored in dense arrays
+indexed by their label (connected components are labelled 1..N, entries
+of unused labels have count 0).
 */
-IslandStats countSizeOfIslands(
-    UIntImagePtr mainIslands, UIntImagePtr subIslands
-) {
+struct IslandIndex {
 
-    IslandStats stats;
+    vector<IslandInfo> mainIslands;
+    vector<IslandInfo> subIslands;
 
-    itk::ImageRegionIterator<UIntImage> itMain(
-        mainIslands, mainIslands->GetLargestPossibleRegion());
-    itk::ImageRegionIterator<UIntImage> itSub(
-        subIslands, subIslands->GetLargestPossibleRegion());
+    // labels of the sub-islands of each main island, in increasing order
+    vector<vector<Label> > subIslandsOfMainIsland;
 
-    for (
-        itMain.GoToBegin(), itSub.GoToBegin();
-        !itMain.IsAtEnd();
-        ++itMain, ++itSub
-    ) {
+    Label maxMainLabel() const { return mainIslands.size() - 1; }
 
-        Label main  = itMain.Get();
-        Label sub = itSub.Get();
+};
 
-        // number of pixels in the whole image
-        stats.count ++;
 
-        // skip pixels outside any main-island
-        if (main == 0) {
-            assert(sub == 0);
-            continue;
-        }
 
-        // retrieve stats for the current main island
-        IslandStats & islandStats = stats.subIslands[main];
 
-        // increase number of pixels in this main island
-        islandStats.count++;
 
-        if (sub == 0)
-            continue;
 
-        // increase number of pixels in the corresponding sub-island
-        islandStats.subIslands[sub].count++;
+/**
+Compute sizes, bounding boxes and the sub->main relation of main islands
+and the corresponding subislands in one pass. Slabs of slices are
+processed in parallel and merged.
+*/
+IslandIndex countSizeOfIslands(
+    UIntImagePtr mainIslands, UIntImagePtr subIslands
+) {
+
+    ImageSize size = mainIslands->GetLargestPossibleRegion().GetSize();
+    const long w = size[0], h = size[1], d = size[2];
+
+    const Label *mainBuffer = mainIslands->GetBufferPointer();
+    const Label *subBuffer = subIslands->GetBufferPointer();
+
+    // per-thread partial index, grown on demand
+    unsigned nThreads = ParallelUtils::numberOfThreads();
+    vector<vector<IslandInfo> > threadMain(nThreads), threadSub(nThreads);
+
+    ParallelUtils::parallelFor(0, d,
+        [&](size_t from, size_t to, unsigned threadId) {
+            vector<IslandInfo> & mainInfo = threadMain[threadId];
+            vector<IslandInfo> & subInfo = threadSub[threadId];
+
+            ImageIndex idx;
+            for (long z = from; z < (long)to; ++z)
+                for (long y = 0; y < h; ++y)
+                    for (long x = 0; x < w; ++x) {
+                        size_t i = x + y * w + z * w * h;
+                        Label main = mainBuffer[i];
+                        Label sub = subBuffer[i];
+
+                        // skip pixels outside any main-island
+                        if (main == 0) {
+                            assert(sub == 0);
+                            continue;
+                        }
+
+                        idx[0] = x; idx[1] = y; idx[2] = z;
+
+                        if (main >= mainInfo.size())
+                            mainInfo.resize(main + 1);
+                        mainInfo[main].addPixel(idx);
+
+                        if (sub == 0)
+                            continue;
+
+                        if (sub >= subInfo.size())
+                            subInfo.resize(sub + 1);
+                        subInfo[sub].mainLabel = main;
+                        subInfo[sub].addPixel(idx);
+                    }
+        });
+
+    // merge partial results
+    IslandIndex index;
+    for (unsigned t = 0; t < nThreads; ++t) {
+        if (threadMain[t].size() > index.mainIslands.size())
+            index.mainIslands.resize(threadMain[t].size());
+        if (threadSub[t].size() > index.subIslands.size())
+            index.subIslands.resize(threadSub[t].size());
+
+        for (Label l = 0; l < threadMain[t].size(); ++l)
+            index.mainIslands[l].merge(threadMain[t][l]);
+        for (Label l = 0; l < threadSub[t].size(); ++l)
+            index.subIslands[l].merge(threadSub[t][l]);
     }
 
+    // label 0 is the background
+    if (index.mainIslands.empty())
+        index.mainIslands.resize(1);
+    if (index.subIslands.empty())
+        index.subIslands.resize(1);
+
+    index.subIslandsOfMainIsland.resize(index.mainIslands.size());
+    for (Label sub = 1; sub < index.subIslands.size(); ++sub) {
+        if (index.subIslands[sub].count > 0) {
+            Label main = index.subIslands[sub].mainLabel;
+            index.subIslandsOfMainIsland[main].push_back(sub);
+        }
+    }
 
-    return stats;
+    return index;
 }
 
 
@@ -136,29 +236,26 @@ Distinguish which main islands should be processed,
 i.e. in which main-islands the erosion caused separation
 of the islands into more (nontrivial) sub-islands.
 */
-void markIslandsToProcess(IslandStats & stats) {
+void markIslandsToProcess(IslandIndex & index) {
 
     // each main label
-    map<Label,IslandStats>::iterator it;
-    for ( it = stats.subIslands.begin() ; it != stats.subIslands.end(); it++ ) {
+    for (Label main = 1; main < index.mainIslands.size(); ++main) {
 
-        IslandStats & mainIsland = it->second;
+        IslandInfo & mainIsland = index.mainIslands[main];
         unsigned mainIslandSize = mainIsland.count;
 
         unsigned subIslandsToProcess = 0;
 
-        map<Label,IslandStats>::iterator subIt;
-        for (
-            subIt = mainIsland.subIslands.begin();
-            subIt != mainIsland.subIslands.end();
-            subIt++
-        ) {
-            unsigned subIslandSize = subIt->second.count;
+        const vector<Label> & subLabels = index.subIslandsOfMainIsland[main];
+        for (unsigned i = 0; i < subLabels.size(); ++i) {
+
+            IslandInfo & subIsland = index.subIslands[subLabels[i]];
+            unsigned subIslandSize = subIsland.count;
 
             float volumeRatio = subIslandSize / (float) mainIslandSize;
 
             if (volumeRatio > 0.001 && subIslandSize > 100) {
-                subIt->second.active = true;
+                subIsland.active = true;
                 subIslandsToProcess++;
             }
         }
@@ -187,31 +284,28 @@ bool LabelSizeSortPredicate(const PairLabelSize& a, const PairLabelSize& b) {
 
 
 /**
-Return vector of island-labels sorted by the size in increasing order.
-If countOnlyActive is true, then only
+Return active sub-island labels of a main island sorted by the size
+in increasing order (islands of equal size by label).
 */
-vector<Label> getIslandLabelsSortedBySize(
-    const map<Label, IslandStats> & islandMap,
-    bool countOnlyActive
+vector<Label> getSubIslandLabelsSortedBySize(
+    const IslandIndex & index,
+    Label mainLabel
 ) {
 
-
     vector<PairLabelSize> labelSizeVector;
 
-    map<Label,IslandStats>::const_iterator it;
-    for (it = islandMap.begin(); it != islandMap.end(); it++) {
-        Label label = it->first;
-        unsigned size = it->second.count;
-        bool active = it->second.active;
+    const vector<Label> & subLabels = index.subIslandsOfMainIsland[mainLabel];
+    for (unsigned i = 0; i < subLabels.size(); ++i) {
+        const IslandInfo & subIsland = index.subIslands[subLabels[i]];
 
-        if (countOnlyActive && !active)
+        if (!subIsland.active)
             continue;
 
-        labelSizeVector.push_back(PairLabelSize(label,size));
+        labelSizeVector.push_back(PairLabelSize(subLabels[i], subIsland.count));
     }
 
     // sort the label-size vector according to size
-    std::sort(
+    std::stable_sort(
         labelSizeVector.begin(), labelSizeVector.end(), LabelSizeSortPredicate);
 
     // extract only labels from the vector
@@ -230,28 +324,78 @@ vector<Label> getIslandLabelsSortedBySize(
 
 
 /**
-True if there's a pixel with intensity @label in the image
-whose distance is less than @maxDistance.
-*/
-bool isIslandWithinDistance(
-    UIntImagePtr image,
-    FloatImagePtr distanceImage,
-    Label label, float maxDistance
-) {
-    itk::ImageRegionIteratorWithIndex<UIntImage> it(
-        image, image->GetLargestPossibleRegion());
-    for (it.GoToBegin(); !it.IsAtEnd(); ++it) {
+Unordered pairs of labels (smaller label first) of sub-islands which are
+closer to each other than maxDistance. Only sub-islands with a nonzero
+label in activeIslands are considered.
 
-        if (it.Get() != label)
-            continue;
+The nearest-island label is propagated to all pixels by one Euclidean
+distance transform (restricted to a band of maxDistance). Two islands
+are adjacent if their Voronoi regions touch at neighbouring pixels p,q with
 
-        float distance = distanceImage->GetPixel(it.GetIndex());
+    dist(p) + |p-q| + dist(q) < maxDistance,
 
-        if (distance < maxDistance)
-            return true;
+which bounds the distance between the islands from above. Compared to
+the exact island-to-island distance, this may miss pairs whose distance is
+within about one pixel of maxDistance, or whose closest points are
+separated by a third island.
+*/
+set<pair<Label, Label> > getAdjacentIslands(
+    UIntImagePtr activeIslands,
+    float maxDistance
+) {
 
-    }
-    return false;
+    EuclideanDistanceTransform<UIntImage, FloatImage> edt;
+    edt.setPropagation(true);
+    edt.setMaximumDistance(maxDistance);
+    FloatImagePtr distanceImage = edt.compute(activeIslands);
+    UIntImagePtr nearestIsland = edt.getPropagationImage();
+
+    ImageSize size = activeIslands->GetLargestPossibleRegion().GetSize();
+    UIntImage::SpacingType spacing = activeIslands->GetSpacing();
+    const long w = size[0], h = size[1], d = size[2];
+    const long strides[3] = { 1, w, w * h };
+
+    const float *distance = distanceImage->GetBufferPointer();
+    const Label *nearest = nearestIsland->GetBufferPointer();
+
+    // each thread collects pairs from its slices
+    vector<set<pair<Label, Label> > > threadPairs(ParallelUtils::numberOfThreads());
+
+    ParallelUtils::parallelFor(0, d,
+        [&](size_t from, size_t to, unsigned threadId) {
+            set<pair<Label, Label> > &pairs = threadPairs[threadId];
+            for (long z = from; z < (long)to; ++z)
+                for (long y = 0; y < h; ++y)
+                    for (long x = 0; x < w; ++x) {
+                        long p = x + y * strides[1] + z * strides[2];
+                        Label labelP = nearest[p];
+                        if (labelP == 0 || distance[p] >= maxDistance)
+                            continue;
+
+                        const long coords[3] = { x, y, z };
+                        const long extent[3] = { w, h, d };
+                        for (unsigned dim = 0; dim < 3; ++dim) {
+                            if (coords[dim] + 1 >= extent[dim])
+                                continue;
+                            long q = p + strides[dim];
+                            Label labelQ = nearest[q];
+                            if (labelQ == 0 || labelQ == labelP)
+                                continue;
+
+                            float estimate = distance[p] + spacing[dim] + distance[q];
+                            if (estimate < maxDistance) {
+                                pairs.insert(pair<Label, Label>(
+                                    std::min(labelP, labelQ), std::max(labelP, labelQ)));
+                            }
+                        }
+                    }
+        });
+
+    set<pair<Label, Label> > adjacent;
+    for (unsigned t = 0; t < threadPairs.size(); ++t)
+        adjacent.insert(threadPairs[t].begin(), threadPairs[t].end());
+
+    return adjacent;
 }
 
 
@@ -268,30 +412,54 @@ Distinguish which subIslands are close to each other enough so it makes
 sense to find bottleneck between them.
 
 Two islands are considered "close to each other" if their
-distance is smaller than maxDistance
+distance is smaller than maxDistance (see getAdjacentIslands)
 */
 vector<pair<Label, Label> > getSubIslandsPairsForSeparation(
-    const IslandStats &stats,
+    const IslandIndex &index,
     UIntImagePtr subIslandsImage,
     unsigned maxDistance
 ) {
 
     vector<pair<Label, Label> > pairs;
 
-    // each main label
-    const map<Label, IslandStats> & mainIslandsMap = stats.subIslands;
-    map<Label,IslandStats>::const_iterator it;
-    for ( it = mainIslandsMap.begin() ; it != mainIslandsMap.end(); it++ ) {
+    // sub-islands which take part in the separation
+    vector<bool> isActive(index.subIslands.size(), false);
+    unsigned activeCount = 0;
+    for (Label sub = 1; sub < index.subIslands.size(); ++sub) {
+        const IslandInfo & subIsland = index.subIslands[sub];
+        if (subIsland.active && index.mainIslands[subIsland.mainLabel].active) {
+            isActive[sub] = true;
+            activeCount++;
+        }
+    }
+
+    if (activeCount == 0)
+        return pairs;
 
-        IslandStats  mainIslandStats = it->second;
+    log("Computing distances from %d sub-islands") % activeCount;
+
+    UIntImagePtr activeIslands = ImageUtils<UIntImage>::duplicate(subIslandsImage);
+    Label *label = activeIslands->GetBufferPointer();
+    size_t total = activeIslands->GetLargestPossibleRegion().GetNumberOfPixels();
+    for (size_t i = 0; i < total; ++i) {
+        if (!isActive[label[i]])
+            label[i] = 0;
+    }
+
+    set<pair<Label, Label> > adjacent =
+        getAdjacentIslands(activeIslands, maxDistance);
+    activeIslands = 0;
+
+    // each main label, pairs ordered as (smaller island, larger island)
+    for (Label main = 1; main < index.mainIslands.size(); ++main) {
 
         // skip islands which should not be process
-        if (mainIslandStats.active == false)
+        if (index.mainIslands[main].active == false)
             continue;
 
         // get sub-islands labels sorted by size from smallest to largest
         vector<Label> subIslandsSortedBySize =
-          getIslandLabelsSortedBySize(mainIslandStats.subIslands, true);
+          getSubIslandLabelsSortedBySize(index, main);
 
         assert(subIslandsSortedBySize.size() >= 2);
 
@@ -302,21 +470,15 @@ vector<pair<Label, Label> > getSubIslandsPairsForSeparation(
         ) {
 
             Label subIsland = subIslandsSortedBySize[mainIdx];
-            log("Computing distace from sub-island %d") % subIsland;
-
-            FloatImagePtr distance =
-                FilterUtils<UIntImage,FloatImage>::distanceMapByFastMarcher(
-                    subIslandsImage, subIsland, maxDistance + 1);
 
             for (unsigned i=mainIdx+1; i < subIslandsSortedBySize.size(); ++i) {
                 Label potentialAdjacentSubIsland = subIslandsSortedBySize[i];
 
-                bool islandsAdjacent = isIslandWithinDistance(
-                    subIslandsImage, distance,
-                    potentialAdjacentSubIsland, maxDistance
-                );
+                pair<Label, Label> key(
+                    std::min(subIsland, potentialAdjacentSubIsland),
+                    std::max(subIsland, potentialAdjacentSubIsland));
 
-                if (islandsAdjacent) {
+                if (adjacent.count(key)) {
                     pairs.push_back(
                         pair<Label,Label>(subIsland,potentialAdjacentSubIsland)
                     );
@@ -379,54 +541,246 @@ public:
 
 /**
 Pixels which are labelled as 1 in segmentedBone image will
-be assigned a new unique label in the resultImage
+be assigned the label @newLabel in the resultImage. The segmentedBone
+image covers the region of resultImage starting at @offset.
+Return true if any pixel was relabelled. Only the relabelled pixels are
+written, so several threads may update disjoint pixels of one result.
 */
-void updateResult(UIntImagePtr resultImage, UIntImagePtr segmentedBone) {
+bool updateResult(
+    UIntImagePtr resultImage, UIntImagePtr segmentedBone, ImageIndex offset,
+    Label newLabel
+) {
 
-    // find unique label as a maximum value of a label in the image plus one
-    Label uniqueLabel = 0;
-    itk::ImageRegionIterator<UIntImage> it(
-        resultImage, resultImage->GetLargestPossibleRegion());
-    for (it.GoToBegin(); !it.IsAtEnd(); ++it) {
-        Label pixelLabel = it.Get();
-        if (pixelLabel >= uniqueLabel)
-            uniqueLabel = pixelLabel + 1;
-    }
+    bool updated = false;
 
     // relabel result image
     itk::ImageRegionIteratorWithIndex<UIntImage> itBone(
         segmentedBone, segmentedBone->GetLargestPossibleRegion());
     for (itBone.GoToBegin(); !itBone.IsAtEnd(); ++itBone) {
-        if (itBone.Get() == 1)
-            resultImage->SetPixel(itBone.GetIndex(), uniqueLabel);
-    }
+        if (itBone.Get() != 1)
+            continue;
 
+        ImageIndex idx = itBone.GetIndex();
+        for (unsigned dim = 0; dim < Dimension; ++dim)
+            idx[dim] += offset[dim];
+        resultImage->SetPixel(idx, newLabel);
+        updated = true;
+    }
 
+    return updated;
 }
 
 
 
 
 
+
+
+
+
 /**
-Find corresponding main island to a given subisland
+Pixels which are labelled as @partitionLabel in the partition image are
+assigned the label @newLabel in the resultImage. The partition covers the
+region of resultImage starting at @offset. Return true if any pixel was
+relabelled. Only the relabelled pixels are written, so several threads may
+update disjoint pixels of one result.
 */
-Label findLabelOfMainIsland(
-    UIntImagePtr mainIslands,
-    UIntImagePtr subIslands,
-    Label subIslandLabel
+bool updateResultWithPartition(
+    UIntImagePtr resultImage, UIntImagePtr partition, ImageIndex offset,
+    Label partitionLabel, Label newLabel
 ) {
 
+    bool updated = false;
+
     itk::ImageRegionIteratorWithIndex<UIntImage> it(
-        subIslands, subIslands->GetLargestPossibleRegion());
+        partition, partition->GetLargestPossibleRegion());
     for (it.GoToBegin(); !it.IsAtEnd(); ++it) {
+        if (it.Get() != partitionLabel)
+            continue;
+
+        ImageIndex idx = it.GetIndex();
+        for (unsigned dim = 0; dim < Dimension; ++dim)
+            idx[dim] += offset[dim];
+        resultImage->SetPixel(idx, newLabel);
+        updated = true;
+    }
+
+    return updated;
+}
+
+
+
+
+
+
+
+
+
+/**
+Copy @region of the label image into a new image starting at index 0.
+If @binarizeLabel is nonzero, pixels with this label are set to 1 and
+all other pixels to 0. Works directly on the buffers, so it may be called
+from several threads on the same image.
+*/
+UIntImagePtr cropIslands(
+    UIntImagePtr image, const ImageRegion & region, Label binarizeLabel = 0
+) {
+    UIntImagePtr crop = ImageUtils<UIntImage>::createEmpty(region.GetSize());
+    crop->SetSpacing(image->GetSpacing());
+
+    ImageSize imageSize = image->GetLargestPossibleRegion().GetSize();
+    ImageSize size = region.GetSize();
+    ImageIndex start = region.GetIndex();
+
+    const Label *in = image->GetBufferPointer();
+    Label *out = crop->GetBufferPointer();
+
+    for (unsigned z = 0; z < size[2]; ++z)
+        for (unsigned y = 0; y < size[1]; ++y) {
+            const Label *row = in + start[0]
+                + (start[1] + y) * imageSize[0]
+                + (start[2] + z) * imageSize[0] * imageSize[1];
+            Label *cropRow = out + y * size[0] + z * size[0] * size[1];
+            for (unsigned x = 0; x < size[0]; ++x) {
+                if (binarizeLabel == 0)
+                    cropRow[x] = row[x];
+                else
+                    cropRow[x] = (row[x] == binarizeLabel) ? 1 : 0;
+            }
+        }
 
-        if (it.Get() == subIslandLabel)
-            return mainIslands->GetPixel(it.GetIndex());
+    return crop;
+}
+
+
+
+
+
+/**
+Find the bottleneck between sub-islands i1 and i2 of the main island
+@mainLabel by a graph-cut within @region. Pixels labelled 1 in the output
+(which covers @region) belong to i1.
+*/
+UIntImagePtr separateSubIslands(
+    UIntImagePtr mainIslands, UIntImagePtr subIslands,
+    Label mainLabel, Label i1, Label i2, const ImageRegion & region
+) {
+    // for the graph-cut we need to supply roi and the cost function
+    UIntImagePtr roi = cropIslands(mainIslands, region, mainLabel);
+    UIntImagePtr subIslandsCrop = cropIslands(subIslands, region);
+    DataCostFunction dataCostFunction(subIslandsCrop, i1, i2);
+    SmoothCostFunction smoothCostFunction;
+
+    // graph-cut segmentation
+    GCSegm gcSegm;
+    return gcSegm.optimize(roi, &dataCostFunction, &smoothCostFunction);
+}
+
+
+
+/**
+Data cost of the multi-label separation: pixels of the seed sub-island of
+a label are bound to this label, other pixels are free.
+*/
+class MultiLabelDataCostFunction: public AESegm::DataCostFunction {
+
+private:
+    // seed image, 1..labels for seed pixels, 0 elsewhere
+    UIntImagePtr seeds;
+
+public:
+
+    // constructor
+    MultiLabelDataCostFunction(UIntImagePtr seedImage) : seeds(seedImage) {}
+
+    virtual int compute(ImageIndex idx, Label label) {
+        Label seed = seeds->GetPixel(idx);
+        if (seed == 0 || seed == label + 1)
+            return 0;
+        else
+            return 1000;
+    }
+};
+
+
+
+class MultiLabelSmoothCostFunction : public AESegm::SmoothnessCostFunction {
+public:
+    virtual int compute(ImageIndex idx1, ImageIndex idx2) {
+        return 1;
+    }
+};
+
+
+
+
+/**
+Separate all @subIslandLabels of the main island @mainLabel at once by
+the alpha-expansion within @region. The output covers @region, pixels of
+the main island are labelled k+1 if they belong to subIslandLabels[k].
+
+The expansion starts from the partition of the main island into the
+regions of the nearest seed.
+*/
+UIntImagePtr separateSubIslandsMultiLabel(
+    UIntImagePtr mainIslands, UIntImagePtr subIslands,
+    Label mainLabel, const vector<Label> & subIslandLabels,
+    const ImageRegion & region
+) {
+    UIntImagePtr roi = cropIslands(mainIslands, region, mainLabel);
+    UIntImagePtr seeds = cropIslands(subIslands, region);
+
+    // seed labels 1..labels in the order of subIslandLabels
+    map<Label, Label> seedOfSubIsland;
+    for (unsigned k = 0; k < subIslandLabels.size(); ++k)
+        seedOfSubIsland[subIslandLabels[k]] = k + 1;
+
+    Label *seed = seeds->GetBufferPointer();
+    size_t total = region.GetNumberOfPixels();
+    for (size_t i = 0; i < total; ++i) {
+        map<Label, Label>::const_iterator it = seedOfSubIsland.find(seed[i]);
+        seed[i] = (it == seedOfSubIsland.end()) ? 0 : it->second;
+    }
+
+    // initial labelling by the nearest seed
+    EuclideanDistanceTransform<UIntImage, FloatImage> edt;
+    edt.setPropagation(true);
+    edt.compute(seeds);
+    UIntImagePtr initialLabels = edt.getPropagationImage();
+
+    MultiLabelDataCostFunction dataCostFunction(seeds);
+    MultiLabelSmoothCostFunction smoothCostFunction;
+
+    AESegm aeSegm;
+    return aeSegm.optimize(
+        roi, initialLabels, subIslandLabels.size(),
+        &dataCostFunction, &smoothCostFunction);
+}
+
+
+
+// expected memory of the graph-cut within a main island, in MB
+double expectedMemoryOfSeparationInMb(
+    const IslandInfo & mainIsland, const ImageRegion & region, unsigned labels = 2
+) {
+    double pixels = region.GetNumberOfPixels();
+
+    if (labels > 2) {
+        // the alpha-expansion, plus the roi, the seeds, the initial labels
+        // and the distance map of the nearest-seed labelling
+        double expansion = AESegm::expectedMemoryInBytes(
+            mainIsland.count, region.GetNumberOfPixels(), labels);
+        double images = 4.0 * pixels * sizeof(Label);
+        return (expansion + images) / (1024 * 1024);
     }
 
-    assert(false);
+    bool is32bit = (sizeof(void*) == 4);
+    double graph = (double) mainIsland.count * ( is32bit ? 124 : 232 );
 
+    // roi, sub-island crop, pixel ids and the result of the last cut
+    double images = 4.0 * pixels * sizeof(Label);
+
+    return (graph + images) / (1024 * 1024);
 }
 
 
@@ -444,21 +798,25 @@ Output: Labelled image with detected bottlenecks between connected components
 Nomenclature:
   mainIslands - connected components in the input binary image
   subIslands - connected components in the eroded input image
+
+If @multiLabelSeparation is set, all sub-islands of a main island which
+take part in some pair are separated by one multi-label cut instead of
+one binary cut per pair. The largest of them keeps the label of the main
+island, the others get new unique labels.
 */
-UCharImagePtr compute(UCharImagePtr inputBinary) {
+UCharImagePtr compute(UCharImagePtr inputBinary, bool multiLabelSeparation = false) {
 
     unsigned EROSION_RADIUS = 3;
     unsigned MAX_DISTANCE_FOR_ADJACENT_BONES = 15;
 
+    ConnectedComponents<UCharImage> connectedComponents;
+
     log("Computing Connected Components");
-    UIntImagePtr mainIslands =
-        FilterUtils<UCharImage,UIntImage>::connectedComponents(inputBinary);
+    UIntImagePtr mainIslands = connectedComponents.compute(inputBinary);
 
     log("Erosion + Connected Components, ball radius=%d") % EROSION_RADIUS;
-    UIntImagePtr subIslands =
-        FilterUtils<UCharImage,UIntImage>::connectedComponents(
-            FilterUtils<UCharImage>::erosion(inputBinary, EROSION_RADIUS)
-        );
+    UIntImagePtr subIslands = connectedComponents.compute(
+        FilterUtils<UCharImage>::erosion(inputBinary, EROSION_RADIUS));
 
 
     /*
@@ -469,47 +827,147 @@ UCharImagePtr compute(UCharImagePtr inputBinary) {
     the subislands 5 and 2 must lie within the same main island.
     */
     log("Discovering main islands containg bottlenecks");
-    IslandStats stats = countSizeOfIslands(mainIslands, subIslands);
-    markIslandsToProcess(stats);
+    IslandIndex index = countSizeOfIslands(mainIslands, subIslands);
+    markIslandsToProcess(index);
     vector<pair<unsigned, unsigned> > subIslandsPairs =
         getSubIslandsPairsForSeparation(
-            stats, subIslands, MAX_DISTANCE_FOR_ADJACENT_BONES);
+            index, subIslands, MAX_DISTANCE_FOR_ADJACENT_BONES);
 
-    // prepare the result image
+    // prepare the result image, separated bones get new unique labels
     UIntImagePtr result = ImageUtils<UIntImage>::duplicate(mainIslands);
+    Label uniqueLabel = index.maxMainLabel() + 1;
 
 
     log("Number of bottlenecks to be found: %d") % subIslandsPairs.size();
 
     /*
-    Let's find the bottlenecks using simplified graph-cut
+    Bottlenecks in different main islands are independent, so each main
+    island is processed by one task and the tasks run in parallel within
+    the memory budget. Pairs of one main island are processed in order.
     */
+    vector<Label> mainLabelsToProcess;
+    map<Label, vector<unsigned> > pairsOfMainIsland;
     for (unsigned i=0; i<subIslandsPairs.size(); ++i) {
-
         Label i1 = subIslandsPairs[i].first;
         Label i2 = subIslandsPairs[i].second;
 
-        Label mainLabel = findLabelOfMainIsland(mainIslands, subIslands, i1);
-        assert(mainLabel == findLabelOfMainIsland(mainIslands, subIslands, i2));
+        Label mainLabel = index.subIslands[i1].mainLabel;
+        assert(mainLabel == index.subIslands[i2].mainLabel);
+
+        if (pairsOfMainIsland[mainLabel].empty())
+            mainLabelsToProcess.push_back(mainLabel);
+        pairsOfMainIsland[mainLabel].push_back(i);
+    }
+
+    MemoryBudget memoryBudget(AVAILABLE_MEMORY_IN_MB);
+
+    if (multiLabelSeparation) {
+
+        // sub-islands of each main island in the pairs, from the smallest
+        // to the largest (pairs are ordered as (smaller, larger))
+        vector<vector<Label> > labelsOfMainIsland(mainLabelsToProcess.size());
+        for (unsigned task = 0; task < mainLabelsToProcess.size(); ++task) {
+            const vector<Label> sorted =
+                getSubIslandLabelsSortedBySize(index, mainLabelsToProcess[task]);
+            const vector<unsigned> & pairIndices =
+                pairsOfMainIsland[mainLabelsToProcess[task]];
+
+            set<Label> inPairs;
+            for (unsigned k = 0; k < pairIndices.size(); ++k) {
+                inPairs.insert(subIslandsPairs[pairIndices[k]].first);
+                inPairs.insert(subIslandsPairs[pairIndices[k]].second);
+            }
+            for (unsigned k = 0; k < sorted.size(); ++k)
+                if (inPairs.count(sorted[k]))
+                    labelsOfMainIsland[task].push_back(sorted[k]);
+        }
+
+        /*
+        Each partition is applied to the result within its task and freed.
+        A partition only labels pixels of its own main island, so the tasks
+        write disjoint pixels of the result. The new labels of a task start
+        at a base fixed before the tasks run (all but the largest sub-island
+        get a new label), so they do not depend on the scheduling and keep
+        the order of the labels used by the serial version.
+        */
+        vector<Label> labelBase(mainLabelsToProcess.size());
+        for (unsigned task = 0; task < mainLabelsToProcess.size(); ++task) {
+            labelBase[task] = uniqueLabel;
+            uniqueLabel += labelsOfMainIsland[task].size() - 1;
+        }
+
+        ParallelUtils::parallelTasks(mainLabelsToProcess.size(),
+            [&](size_t task, unsigned) {
+                Label mainLabel = mainLabelsToProcess[task];
+                const vector<Label> & labels = labelsOfMainIsland[task];
+
+                ImageRegion region = index.mainIslands[mainLabel].getBoundingBox(
+                    1, mainIslands->GetLargestPossibleRegion());
 
-        log("Identifying bottleneck between sub-islands %d and %d within main island %d")
-            % i1 % i2 % mainLabel;
+                double memoryMb = expectedMemoryOfSeparationInMb(
+                    index.mainIslands[mainLabel], region, labels.size());
+                memoryBudget.acquire(memoryMb);
 
-        // for the graph-cut we need to supply roi and the cost function
-        UIntImagePtr roi = FilterUtils<UIntImage>::binaryThresholding(
-            mainIslands, mainLabel,mainLabel);
-        DataCostFunction dataCostFunction(subIslands, i1, i2);
-        SmoothCostFunction smoothCostFunction;
+                log("Separating %d sub-islands within main island %d")
+                    % labels.size() % mainLabel;
 
-        // graph-cut segmentation
-        GCSegm gcSegm;
-        UIntImagePtr gcOutput =
-            gcSegm.optimize(roi, &dataCostFunction, &smoothCostFunction);
+                UIntImagePtr partition = separateSubIslandsMultiLabel(
+                    mainIslands, subIslands, mainLabel, labels, region);
 
-        // update the result image
-        updateResult(result, gcOutput);
+                // the largest sub-island (last label) keeps the main label
+                for (Label k = 1; k < labels.size(); ++k) {
+                    updateResultWithPartition(
+                        result, partition, region.GetIndex(),
+                        k, labelBase[task] + k - 1);
+                }
+                partition = 0;
+
+                memoryBudget.release(memoryMb);
+            });
+
+        return FilterUtils<UIntImage,UCharImage>::relabelComponents(result);
     }
 
+    /*
+    Let's find the bottlenecks using simplified graph-cut
+
+    Each cut is applied to the result within its task and freed. A cut only
+    relabels pixels of its own main island, so the tasks write disjoint
+    pixels of the result. The pair i gets the label uniqueLabel + i, which
+    does not depend on the scheduling and keeps the order of the labels
+    used by the serial version (the final relabelling only depends on it).
+    */
+    ParallelUtils::parallelTasks(mainLabelsToProcess.size(),
+        [&](size_t task, unsigned) {
+            Label mainLabel = mainLabelsToProcess[task];
+            const vector<unsigned> & pairIndices =
+                pairsOfMainIsland.find(mainLabel)->second;
+
+            // the graph-cut is computed only within the bounding box of the
+            // main island (padded by a pixel)
+            ImageRegion region = index.mainIslands[mainLabel].getBoundingBox(
+                1, mainIslands->GetLargestPossibleRegion());
+
+            double memoryMb =
+                expectedMemoryOfSeparationInMb(index.mainIslands[mainLabel], region);
+            memoryBudget.acquire(memoryMb);
+
+            for (unsigned k = 0; k < pairIndices.size(); ++k) {
+                unsigned i = pairIndices[k];
+                Label i1 = subIslandsPairs[i].first;
+                Label i2 = subIslandsPairs[i].second;
+
+                log("Identifying bottleneck between sub-islands %d and %d within main island %d")
+                    % i1 % i2 % mainLabel;
+
+                UIntImagePtr cut = separateSubIslands(
+                    mainIslands, subIslands, mainLabel, i1, i2, region);
+                updateResult(result, cut, region.GetIndex(), uniqueLabel + i);
+            }
+
+            memoryBudget.release(memoryMb);
+        });
+
 
     // before we are finished, relabel componenets of the result according to
     // the size, i.e. 0 - background, 1 - largest, 2 - second largest, ...
@@ -100,6 +100,15 @@ int main(int argc, char * argv [])
     sigmasLargeScale.push_back(0.6);
     sigmasLargeScale.push_back(0.8);
 
+    // compute the small-scale sheetness on a downsampled image,
+    // optionally reporting its accuracy against the full resolution
+    bool smallScalePyramid = false;
+    bool reportPyramidAccuracy = false;
+
+    // separate all bones of a main island by one multi-label cut
+    // instead of one binary cut per pair of adjacent bones
+    bool multiLabelSeparation = false;
+
 
 
     vector<ImageRegion> subRegions;
@@ -114,7 +123,9 @@ int main(int argc, char * argv [])
         FloatImagePtr sheetness;
         UCharImagePtr softTissueEst;
         boost::tie(roi, sheetness, softTissueEst) =
-            Preprocessing::compute(inputCT, sigmaSmallScale, sigmasLargeScale);
+            Preprocessing::compute(
+                inputCT, sigmaSmallScale, sigmasLargeScale,
+                smallScalePyramid, reportPyramidAccuracy);
 
         logSetStage("Disassembly");
         subRegions = ImageSplitter<UCharImage>::splitIntoRegions(roi);
@@ -194,7 +205,8 @@ int main(int argc, char * argv [])
 	//-----------------------------------
 
     logSetStage("Bone Separation");
-    UCharImagePtr finalResult = BoneSeparation::compute(assembledResult);
+    UCharImagePtr finalResult = BoneSeparation::compute(
+        assembledResult, multiLabelSeparation);
 
 
 
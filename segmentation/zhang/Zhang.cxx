@@ -1,20 +1,22 @@
 
 #include <iostream>
+#include <cmath>
 
 
 #include "Globals.hpp"
 #include "ImageUtils.hpp"
 #include "FilterUtils.hpp"
+#include "ConnectedComponents.hpp"
+#include "ParallelUtils.hpp"
 
 #include "itkImageRegionIteratorWithIndex.h"
-#include "itkConstNeighborhoodIterator.h"
-#include "itkNeighborhoodIterator.h"
 #include "itkImageRegionIterator.h"
 
 #include "boost/tuple/tuple.hpp"
 #include "boost/lexical_cast.hpp"
 
 #include <vector>
+#include <algorithm>
 
 using namespace std;
 //////////////////////////////////////////
@@ -76,167 +78,409 @@ namespace SystemUtils {
 
 
 
-void addOffset(vector<ImageOffset> &offsets, int x, int y, int z) {
-    ImageOffset offset;
-    offset[0] = x;
-    offset[1] = y;
-    offset[2] = z;
-    offsets.push_back(offset);
-}
-
+/*
+Bone voxel (B == 1) with a non-bone voxel in its 10-neighbourhood (the 8
+neighbours within the slice and the 2 neighbours in the adjacent slices),
+neighbours outside the image are ignored.
+*/
+bool isBoundaryVoxel(const short *bone, const ImageSize & size, int x, int y, int z) {
 
-ShortImagePtr computeBoundaryVoxels(ShortImagePtr B) {
+    const int w = size[0], h = size[1], d = size[2];
+    const size_t wh = (size_t)w * h;
+    const size_t idx = x + (size_t)y * w + z * wh;
 
-    ShortImagePtr boundaryVoxels = FilterUtils<ShortImage>::createEmptyFrom(B);
-    itk::ImageRegionIteratorWithIndex<ShortImage>it(B, B->GetLargestPossibleRegion());
-    ImageSize imageSize = B->GetLargestPossibleRegion().GetSize();
+    if (bone[idx] != 1)
+        return false;
 
-    //prepare the neighborhood
-    vector<ImageOffset> offsets;
-    addOffset(offsets, -1, -1,  0);
-    addOffset(offsets, -1,  0,  0);
-    addOffset(offsets, -1, +1,  0);
-    addOffset(offsets,  0, -1,  0);
-    addOffset(offsets,  0, +1,  0);
-    addOffset(offsets, +1, -1,  0);
-    addOffset(offsets, +1,  0,  0);
-    addOffset(offsets, +1, +1,  0);
-    addOffset(offsets,  0,  0, -1);
-    addOffset(offsets,  0,  0, +1);
-
-    for (it.GoToBegin(); !it.IsAtEnd(); ++it) {
-
-        ImageIndex cIndex = it.GetIndex();
-        bool isCenterBone = (it.Get() == 1);
-
-        // non-bone => not a boundary pixel
-        if (!isCenterBone) {
-            boundaryVoxels->SetPixel(cIndex, 0);
-            continue;
+    // explore the 8-neighborhood within the slice
+    for (int dy = -1; dy <= 1; ++dy)
+        for (int dx = -1; dx <= 1; ++dx) {
+            if ((dx == 0 && dy == 0) ||
+                    x + dx < 0 || x + dx >= w || y + dy < 0 || y + dy >= h)
+                continue;
+            if (bone[idx + dx + dy * w] != 1)
+                return true;
         }
 
-        // explore the 10-neighborhood of the central pixel
-        for (unsigned i=0; i < offsets.size(); ++i) {
+    // and the neighbours in the adjacent slices
+    if (z > 0 && bone[idx - wh] != 1)
+        return true;
+    if (z < d - 1 && bone[idx + wh] != 1)
+        return true;
 
-            ImageIndex nIndex = cIndex + offsets[i];
-            if(!ImageUtils<ShortImage>::isInside(B,nIndex))
-                continue;
+    return false;
+}
 
-            bool isNeighBone = (B->GetPixel(nIndex) == 1);
 
-            // non-bone neigh => a boundary pixel detected
-            if (!isNeighBone) {
-                boundaryVoxels->SetPixel(cIndex, 1);
-                goto endOfImageLoop;
-            }
-        }
 
-        // no non-bone voxel detected => not a boundary pixel
-        boundaryVoxels->SetPixel(cIndex, 0);
+// indices of all boundary voxels in increasing order
+vector<size_t> computeBoundaryVoxels(ShortImagePtr B) {
 
-endOfImageLoop:
-        ;
-    } // iterating through the image
+    ImageSize size = B->GetLargestPossibleRegion().GetSize();
+    const short *bone = B->GetBufferPointer();
 
+    vector<size_t> boundaryVoxels;
+    size_t idx = 0;
+    for (int z = 0; z < (int)size[2]; ++z)
+        for (int y = 0; y < (int)size[1]; ++y)
+            for (int x = 0; x < (int)size[0]; ++x, ++idx)
+                if (isBoundaryVoxel(bone, size, x, y, z))
+                    boundaryVoxels.push_back(idx);
 
     return boundaryVoxels;
 }
 
 
 
-float dNorm(float mu, float sigma2, float x) {
-    return exp(-pow(x - mu,2)/(2*sigma2)) / sqrt(2*3.14159265358797*sigma2);
+/*
+Boundary voxels after the voxels in @changed were removed from B.
+
+The classification of a voxel depends only on B within its window, which
+contains its 10-neighbourhood, so only voxels in the window of a changed
+voxel may change their boundary state or classification. The others
+would be classified the same way as in the previous iteration, i.e. they
+stay bone. If the windows of the changed voxels cover more voxels than the
+image, the whole image is scanned instead.
+
+@marked is an image-sized scratch array of zeros, it is zero on return.
+*/
+vector<size_t> updateBoundaryVoxels(
+    ShortImagePtr B, const vector<size_t> & changed, vector<unsigned char> & marked
+) {
+
+    ImageSize size = B->GetLargestPossibleRegion().GetSize();
+    const int w = size[0], h = size[1], d = size[2];
+    const size_t wh = (size_t)w * h;
+
+    size_t windowSize =
+        (2*WINDOW_SPAN_X+1) * (2*WINDOW_SPAN_Y+1) * (2*WINDOW_SPAN_Z+1);
+    if (changed.size() * windowSize >= wh * d)
+        return computeBoundaryVoxels(B);
+
+    const short *bone = B->GetBufferPointer();
+
+    vector<size_t> boundaryVoxels;
+    vector<size_t> visited;
+
+    for (unsigned k = 0; k < changed.size(); ++k) {
+        int cx = changed[k] % w;
+        int cy = (changed[k] / w) % h;
+        int cz = changed[k] / wh;
+
+        for (int z = std::max(0, cz - (int)WINDOW_SPAN_Z);
+                z <= std::min(d - 1, cz + (int)WINDOW_SPAN_Z); ++z)
+            for (int y = std::max(0, cy - (int)WINDOW_SPAN_Y);
+                    y <= std::min(h - 1, cy + (int)WINDOW_SPAN_Y); ++y)
+                for (int x = std::max(0, cx - (int)WINDOW_SPAN_X);
+                        x <= std::min(w - 1, cx + (int)WINDOW_SPAN_X); ++x) {
+                    size_t idx = x + (size_t)y * w + z * wh;
+                    if (marked[idx])
+                        continue;
+                    marked[idx] = 1;
+                    visited.push_back(idx);
+
+                    if (isBoundaryVoxel(bone, size, x, y, z))
+                        boundaryVoxels.push_back(idx);
+                }
+    }
+
+    for (unsigned k = 0; k < visited.size(); ++k)
+        marked[visited[k]] = 0;
+
+    std::sort(boundaryVoxels.begin(), boundaryVoxels.end());
+    return boundaryVoxels;
 }
 
 
 
+/*
+Is intensity i more likely to come from the non-bone class than from the
+bone class, i.e.
+
+    N(i; meanNonBone, varNonBone) * Nnb  >  N(i; meanBone, varBone) * Nb
+
+for gaussian densities N? Compared in the log domain, with one logarithm
+instead of the exp/pow/sqrt of both densities:
+
+    (i-meanBone)^2/varBone - (i-meanNonBone)^2/varNonBone
+        >  log( varNonBone * Nb^2 / (varBone * Nnb^2) )
+
+This differs from comparing the densities in floats only by rounding and
+where the densities underflowed (both below ~1e-45, the voxel was then
+kept as bone). Zero or undefined variances keep the voxel as bone in both.
+*/
+bool isMoreLikelyNonBone(
+    float i, float meanBone, float varBone, int Nb,
+    float meanNonBone, float varNonBone, int Nnb
+) {
+    float dBone = i - meanBone;
+    float dNonBone = i - meanNonBone;
+    float lhs = dBone * dBone / varBone - dNonBone * dNonBone / varNonBone;
+    float rhs = logf(
+        (varNonBone * (float)Nb * (float)Nb) / (varBone * (float)Nnb * (float)Nnb));
+    return lhs > rhs;
+}
+
+
 
-boost::tuple<ShortImagePtr, unsigned> identifyMisclassifiedVoxels(
-    ShortImagePtr inputImg, ShortImagePtr B, ShortImagePtr Eb
-){
 
-    ShortImagePtr errorImg = FilterUtils<ShortImage>::createEmptyFrom(B);
-
-    typedef itk::NeighborhoodIterator<ShortImage> NeighborhoodIteratorType;
-    typedef itk::ImageRegionIteratorWithIndex<ShortImage> ImageRegionIterator;
-
-    NeighborhoodIteratorType::RadiusType radius;
-    radius[0] = WINDOW_SPAN_X;
-    radius[1] = WINDOW_SPAN_Y;
-    radius[2] = WINDOW_SPAN_Z;
-    int size = (2*radius[0]+1) * (2*radius[1]+1)* (2*radius[2]+1);
-
-    ImageRegionIterator itBorderPixels(Eb, Eb->GetLargestPossibleRegion());
-    ImageRegionIterator itError(errorImg, errorImg->GetLargestPossibleRegion());
-    NeighborhoodIteratorType itIntensity(radius, inputImg, inputImg->GetLargestPossibleRegion());
-    NeighborhoodIteratorType itBone(radius, B, B->GetLargestPossibleRegion());
-
-    ImageSize imageSize = Eb->GetLargestPossibleRegion().GetSize();
-    unsigned totalPixels = imageSize[0] * imageSize[1] * imageSize[2];
-
-    // iterate over the input image
-    unsigned reclasiffied = 0;
-
-//    unsigned counter = 0;
-    for (
-        itBorderPixels.GoToBegin(), itIntensity.GoToBegin(), itError.GoToBegin(), itBone.GoToBegin();
-        !itBorderPixels.IsAtEnd();
-        ++itBorderPixels, ++itIntensity, ++itError, ++itBone
-    ) {
-//        counter ++;
-//        if (counter % 1000 == 0)
-//            fprintf(stdout, "\r%2.3f%%   ", 100 * counter / (1.0 * totalPixels) );
-
-        // skip non-border pixels
-        if (itBorderPixels.Get() == 0 )
-            continue;
-
-        assert(itBone.GetCenterPixel() == 1);
-
-        // compute means and variances for bone and non-bone classes
-        float meanBone = 0;
-        float meanNonBone = 0;
-        float varBone = 0;
-        float varNonBone = 0;
-
-        int Nb = 0, Nnb = 0;
-        for (int idx = 0; idx < size; ++idx) {
-            bool isBone = (itBone.GetPixel(idx) == 1);
-            short i = itIntensity.GetPixel(idx);
-            if (isBone) {
-                meanBone += i;
-                varBone += i*i;
-                Nb++;
-            } else {
-                meanNonBone += i;
-                varNonBone += i*i;
-                Nnb++;
+/*
+Sums of B, I*B, I^2*B, I and I^2 (B - bone mask, I - intensity) over the
+window of WINDOW_SPAN_X x WINDOW_SPAN_Y x WINDOW_SPAN_Z around a voxel.
+
+For each slice z, the slices z-WINDOW_SPAN_Z..z+WINDOW_SPAN_Z are summed and
+a summed-area table of the sums is built, so the window sums of any voxel
+of the slice are obtained by a constant number of lookups. Pixels outside
+of the image are replaced by the nearest pixel inside, as by the zero-flux
+boundary condition of itk::NeighborhoodIterator.
+*/
+class WindowStatistics {
+
+public:
+
+    struct Sums {
+        long long b, ib, iib, i, ii;
+
+        Sums() : b(0), ib(0), iib(0), i(0), ii(0) {}
+
+        void add(const Sums & other, long long weight) {
+            b += weight * other.b;
+            ib += weight * other.ib;
+            iib += weight * other.iib;
+            i += weight * other.i;
+            ii += weight * other.ii;
+        }
+    };
+
+    WindowStatistics(ShortImagePtr inputImg, ShortImagePtr B) :
+        m_intensity(inputImg->GetBufferPointer()),
+        m_bone(B->GetBufferPointer())
+    {
+        ImageSize size = B->GetLargestPossibleRegion().GetSize();
+        m_w = size[0];
+        m_h = size[1];
+        m_d = size[2];
+    }
+
+
+
+    // build the summed-area table for the windows centered in slice z
+    void computeSlice(int z) {
+
+        // the table is allocated on the first use
+        m_table.resize((size_t)(m_w + 1) * (m_h + 1));
+
+        const size_t wh = (size_t)m_w * m_h;
+        std::vector<Sums> row(m_w);
+
+        // row 0 and column 0 of the table are zero
+        for (int y = 0; y < m_h; ++y) {
+
+            std::fill(row.begin(), row.end(), Sums());
+            for (int dz = -(int)WINDOW_SPAN_Z; dz <= (int)WINDOW_SPAN_Z; ++dz) {
+                int zz = std::min(m_d - 1, std::max(0, z + dz));
+                const short *intensity = m_intensity + zz * wh + (size_t)y * m_w;
+                const short *bone = m_bone + zz * wh + (size_t)y * m_w;
+                for (int x = 0; x < m_w; ++x) {
+                    long long i = intensity[x];
+                    long long b = (bone[x] == 1) ? 1 : 0;
+                    row[x].b += b;
+                    row[x].ib += b * i;
+                    row[x].iib += b * i * i;
+                    row[x].i += i;
+                    row[x].ii += i * i;
+                }
+            }
+
+            Sums rowSum;
+            Sums *above = &m_table[(size_t)y * (m_w + 1) + 1];
+            Sums *current = &m_table[(size_t)(y + 1) * (m_w + 1) + 1];
+            for (int x = 0; x < m_w; ++x) {
+                rowSum.add(row[x], 1);
+                current[x] = above[x];
+                current[x].add(rowSum, 1);
             }
         }
-        assert(Nb + Nnb == size);
-        assert(Nb > 0);
-        assert(Nnb > 0);
+    }
+
 
-        meanBone /= Nb;
-        meanNonBone /= Nnb;
-        varBone = (Nb / (Nb - 1.0)) * ((varBone / Nb) - meanBone*meanBone);
-        varNonBone = (Nnb / (Nnb - 1.0)) * ((varNonBone / Nnb) - meanNonBone*meanNonBone);
 
-        short i = itIntensity.GetCenterPixel();
-        float pBone    = dNorm(meanBone, varBone, i) * ( Nb / (1.0 *size));
-        float pNonBone = dNorm(meanNonBone, varNonBone, i) * ( Nnb / (1.0 *size));
+    // sums over the window centered in (x,y) of the current slice
+    Sums window(int x, int y) const {
 
-//        log("(%7.1f,%7.1f)  (%7.1f,%7.1f)  %5.10f %5.10f")
-//            % meanBone % varBone % meanNonBone % varNonBone % pBone % pNonBone;
+        Segment segX[3], segY[3];
+        int nx = clampedSegments(x, WINDOW_SPAN_X, m_w, segX);
+        int ny = clampedSegments(y, WINDOW_SPAN_Y, m_h, segY);
+
+        Sums sums;
+        for (int i = 0; i < nx; ++i)
+            for (int j = 0; j < ny; ++j)
+                sums.add(
+                    rectangle(segX[i].from, segX[i].to, segY[j].from, segY[j].to),
+                    segX[i].weight * segY[j].weight);
+        return sums;
+    }
 
-        if (pNonBone > pBone) {
-            itError.Set(1);
-            reclasiffied++;
+
+    // sums over the window centered in (x,y,z) computed directly, cheaper
+    // than computeSlice for a few voxels of a slice
+    Sums directWindow(int x, int y, int z) const {
+
+        const size_t wh = (size_t)m_w * m_h;
+
+        Sums sums;
+        for (int dz = -(int)WINDOW_SPAN_Z; dz <= (int)WINDOW_SPAN_Z; ++dz) {
+            int zz = std::min(m_d - 1, std::max(0, z + dz));
+            for (int dy = -(int)WINDOW_SPAN_Y; dy <= (int)WINDOW_SPAN_Y; ++dy) {
+                int yy = std::min(m_h - 1, std::max(0, y + dy));
+                size_t row = zz * wh + (size_t)yy * m_w;
+                for (int dx = -(int)WINDOW_SPAN_X; dx <= (int)WINDOW_SPAN_X; ++dx) {
+                    int xx = std::min(m_w - 1, std::max(0, x + dx));
+                    long long i = m_intensity[row + xx];
+                    long long b = (m_bone[row + xx] == 1) ? 1 : 0;
+                    sums.b += b;
+                    sums.ib += b * i;
+                    sums.iib += b * i * i;
+                    sums.i += i;
+                    sums.ii += i * i;
+                }
+            }
+        }
+        return sums;
+    }
+
+
+private:
+
+    // pixels [from,to] of an axis, each counted weight times
+    struct Segment {
+        int from, to, weight;
+    };
+
+    const short *m_intensity;
+    const short *m_bone;
+    int m_w, m_h, m_d;
+
+    // summed-area table, m_table[(y+1)*(w+1) + (x+1)] holds the sums
+    // over [0,x] x [0,y]
+    std::vector<Sums> m_table;
+
+
+
+    // split the clamped range center-span..center+span of an axis of
+    // length n into the part inside and the repeated border pixels
+    static int clampedSegments(int center, int span, int n, Segment segments[3]) {
+        int from = center - span;
+        int to = center + span;
+        int count = 0;
+
+        Segment inside = { std::max(from, 0), std::min(to, n - 1), 1 };
+        segments[count++] = inside;
+
+        if (from < 0) {
+            Segment first = { 0, 0, -from };
+            segments[count++] = first;
+        }
+        if (to > n - 1) {
+            Segment last = { n - 1, n - 1, to - (n - 1) };
+            segments[count++] = last;
         }
+        return count;
     }
 
 
-    return boost::make_tuple(errorImg, reclasiffied);
+
+    Sums rectangle(int x0, int x1, int y0, int y1) const {
+        const size_t stride = m_w + 1;
+        Sums sums = m_table[(y1 + 1) * stride + (x1 + 1)];
+        sums.add(m_table[y0 * stride + (x1 + 1)], -1);
+        sums.add(m_table[(y1 + 1) * stride + x0], -1);
+        sums.add(m_table[y0 * stride + x0], 1);
+        return sums;
+    }
+
+};
+
+
+
+
+/*
+Boundary voxels (indices in increasing order) which are more likely to
+be non-bone than bone given the intensities in their window. B is not
+changed. The slices are classified in parallel, each thread has its own
+summed-area table.
+*/
+vector<size_t> identifyMisclassifiedVoxels(
+    ShortImagePtr inputImg, ShortImagePtr B, const vector<size_t> & boundaryVoxels
+){
+
+    int size = (2*WINDOW_SPAN_X+1) * (2*WINDOW_SPAN_Y+1) * (2*WINDOW_SPAN_Z+1);
+
+    ImageSize imageSize = B->GetLargestPossibleRegion().GetSize();
+    const int w = imageSize[0], h = imageSize[1];
+    const size_t wh = (size_t)w * h;
+
+    const short *intensity = inputImg->GetBufferPointer();
+
+    // boundary voxels of each slice are boundaryVoxels[sliceStart[s]..sliceStart[s+1])
+    vector<size_t> sliceStart;
+    for (size_t k = 0; k < boundaryVoxels.size(); ++k) {
+        if (k == 0 || boundaryVoxels[k] / wh != boundaryVoxels[k-1] / wh)
+            sliceStart.push_back(k);
+    }
+    sliceStart.push_back(boundaryVoxels.size());
+    size_t slices = sliceStart.size() - 1;
+
+    vector<WindowStatistics> statistics(
+        ParallelUtils::numberOfThreads(), WindowStatistics(inputImg, B));
+    vector<vector<size_t> > misclassifiedInSlice(slices);
+
+    ParallelUtils::parallelTasks(slices,
+        [&](size_t s, unsigned threadId) {
+            WindowStatistics & stats = statistics[threadId];
+            size_t first = sliceStart[s];
+            size_t last = sliceStart[s+1];
+            int z = boundaryVoxels[first] / wh;
+
+            // the summed-area table pays off only for many voxels in the slice
+            bool useTable = (last - first) * size > 4 * wh;
+            if (useTable)
+                stats.computeSlice(z);
+
+            for (size_t k = first; k < last; ++k) {
+                size_t idx = boundaryVoxels[k];
+                int x = idx % w;
+                int y = (idx / w) % h;
+
+                // compute means and variances for bone and non-bone classes
+                WindowStatistics::Sums sums = useTable ?
+                    stats.window(x, y) : stats.directWindow(x, y, z);
+
+                int Nb = sums.b;
+                int Nnb = size - Nb;
+                assert(Nb > 0);
+                assert(Nnb > 0);
+
+                double meanBone = sums.ib / (double) Nb;
+                double meanNonBone = (sums.i - sums.ib) / (double) Nnb;
+                float varBone = (Nb / (Nb - 1.0)) *
+                    (sums.iib / (double) Nb - meanBone*meanBone);
+                float varNonBone = (Nnb / (Nnb - 1.0)) *
+                    ((sums.ii - sums.iib) / (double) Nnb - meanNonBone*meanNonBone);
+
+                if (isMoreLikelyNonBone(intensity[idx],
+                        meanBone, varBone, Nb, meanNonBone, varNonBone, Nnb))
+                    misclassifiedInSlice[s].push_back(idx);
+            }
+        });
+
+    // concatenate the slices in order
+    vector<size_t> misclassified;
+    for (size_t s = 0; s < slices; ++s)
+        misclassified.insert(misclassified.end(),
+            misclassifiedInSlice[s].begin(), misclassifiedInSlice[s].end());
+
+    return misclassified;
 
 }
 
@@ -263,41 +507,48 @@ int main(int argc, char * argv [])
 
     log("Initial thresholding [T=%d]") % INITIAL_THRESHOLD;
     ShortImagePtr B =
-        FilterUtils<ShortImage>::binaryThresholding(
-            FilterUtils<ShortImage>::relabelComponents(
-                FilterUtils<ShortImage>::connectedComponents(
-                FilterUtils<ShortImage>::binaryThresholding(
-                    inputImg, -5000, INITIAL_THRESHOLD)
-                )),
-            1,1,0,1
-        );
+        ConnectedComponents<ShortImage>::largestComponent<ShortImage>(
+            FilterUtils<ShortImage>::binaryThresholding(
+                inputImg, -5000, INITIAL_THRESHOLD),
+            0, 1);
 
 //    string filename = string(argv[2]) + "0.nii";
 //    log("Saving results of this step to %s") % filename;
 //    ImageUtils<ShortImage>::writeImage(filename, B);
 
 
+    /*
+    B is updated in place. In each iteration only the boundary voxels
+    near the voxels removed in the previous iteration are examined.
+    */
+    log("Computing boundary voxels");
+    vector<size_t> boundaryVoxels = computeBoundaryVoxels(B);
+
+    ImageSize imageSize = B->GetLargestPossibleRegion().GetSize();
+    vector<unsigned char> marked(imageSize[0] * imageSize[1] * imageSize[2], 0);
+    short *bone = B->GetBufferPointer();
+
     unsigned iteration = 1;
     bool converged = false;
 
     while (!converged) {
         logSetStage("Iteration#" + boost::lexical_cast<string>(iteration));
 
-        log("Computing boundary voxels");
-        ShortImagePtr Eb = computeBoundaryVoxels(B);
-
-        log("Identifying mis-classified boundary voxels");
-        ShortImagePtr errorImg;
-        unsigned totalErrorVoxels;
-        boost::tie(errorImg, totalErrorVoxels) =
-            identifyMisclassifiedVoxels(inputImg, B, Eb);
-
+        log("Identifying mis-classified voxels among %d boundary voxels")
+            % boundaryVoxels.size();
+        vector<size_t> errorVoxels =
+            identifyMisclassifiedVoxels(inputImg, B, boundaryVoxels);
+        unsigned totalErrorVoxels = errorVoxels.size();
 
         log("%d voxels in the error class, updating the segmentation") % totalErrorVoxels;
-        B = FilterUtils<ShortImage>::negatedMask(B, errorImg);
-
+        for (unsigned k = 0; k < errorVoxels.size(); ++k)
+            bone[errorVoxels[k]] = 0;
 
         converged = (totalErrorVoxels < 500);
+        if (!converged) {
+            log("Updating boundary voxels");
+            boundaryVoxels = updateBoundaryVoxels(B, errorVoxels, marked);
+        }
         iteration++;
     }
 